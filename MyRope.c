@@ -1,18 +1,47 @@
 // Invariants:
-// leftLen is always the length of the left subtree
+// leftLen is always the length of the left subtree, and in a leaf the number of characters in the leaf
+// leftLines is the number of newline characters in the same characters, so lines are found like characters
+// leftChars is the number of UTF-8 code points in them, counted as the bytes that do not continue a sequence,
+// so the counts stay exact even if a leaf boundary cuts a multibyte sequence
+// The tree below the root is an AVL tree: the heights of the subtrees of any node differ at most by one
+// height is zero for a leaf and one more than the higher subtree for other nodes
+// Nodes other than the root and leafs have both subtrees
 // Root never has a right subtree
-// Root never has data (except terminating NULL character)
+// Root never has data
 // Node is leaf if and only if its left and right subtree are NULL
-// Data in each node starts from index zero and ends with a terminal NULL character
-// If node is not leaf, its data has nothing but the terminal NULL character
+// Data in each leaf starts from index zero and has leftLen characters without a terminal NULL character,
+// so a rope may hold any bytes, NULL characters included
+// If node is not leaf, its data is NULL
+// A node may be shared by several ropes, refs counts the references to it
+// A shared node is never changed: it is copied first, so a change copies only the nodes on its path
+// Root is never shared, only the tree below it
+// Nodes have no parent links, because a shared node has a parent in each rope that contains it
+// A leaf has room for capacity characters, so small edits change it in place up to LEAF_MAX_SIZE characters
+// A leaf with NODE_SHARED_TEXT does not own its data: the data is a part of a read-only shared text,
+// such as a mapped file, and the leaf gets a data block of its own only when it is changed
+// A malloc'd leaf longer than LEAF_MAX_SIZE turns its own block into a shared text when it is made
+// or split, before any other rope can see it, so its parts and copies refer to the block instead of copying it
+// Lengths, indexes and counts of a rope are ropeSize, 64 bits, so a rope may be longer than 2 GiB,
+// but a leaf never has more than INT32_MAX characters, so lengths and indexes inside a leaf are int
 
-#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 enum ErrorCodes {OK, ARGS, PARAM, ALLOC, INTERNAL, NOTDOUBLE, BOUNDINGBOXARGS};
-enum ErrorCodes currentError = OK;
+_Thread_local enum ErrorCodes currentError = OK; // Each thread sees the errors of its own calls
 
 void errorOccurred() {
 	switch (currentError) {
@@ -32,14 +61,35 @@ void errorOccurred() {
 	exit(EXIT_FAILURE);
 }
 
+typedef int64_t ropeSize;
+
+// The node is 64 bytes, one cache line: the small fields share one word, and a leaf
+// has either room of its own or a shared text, never both
 struct node {
 	char* data;
-	int leftLen;
+	ropeSize leftLen;
+	ropeSize leftLines; // Newlines in the left subtree, or in the leaf
+	ropeSize leftChars; // UTF-8 code points in the left subtree, or in the leaf
+	unsigned char flags; // NODE_IN_ARENA, NODE_OWNS_ARENA, NODE_SHARED_TEXT
+	unsigned char textClass; // Size class of data when the node is in an arena
+	unsigned char height;
+	int refs; // Number of parents and ropes that refer to the node
+	union {
+		int capacity; // Room for characters in data, if the leaf does not have NODE_SHARED_TEXT
+		struct sharedText* text; // Text that data is a part of, if the leaf has NODE_SHARED_TEXT
+		unsigned int version; // Changes of the rope, in the root, which has no data, see ropeChanged
+	};
 	struct node* left;
 	struct node* right;
-	struct node* parent;
 };
 
+#define LEAF_MAX_SIZE 1024 // Leaves are not grown in place beyond this
+#define LEAF_MIN_SIZE 128 // A leaf that shrinks below this in place is merged with a neighbour
+
+// Maximum depth of a rope, root included
+// The tree below the root is an AVL tree, so its height is less than 1.45 * log2(number of leaves + 2)
+#define ROPE_MAX_DEPTH 64
+
 struct location {
 	struct node* myNode;
 	int myIndex;
@@ -49,319 +99,1554 @@ int myMin (const int a, const int b) { // Why does not inline work with gcc?
 	return (a < b) ? a : b;
 }
 
+// myMin for rope lengths, so that a length beyond int is not cut before the comparison
+ropeSize sizeMin (const ropeSize a, const ropeSize b) {
+	return (a < b) ? a : b;
+}
+
+// Counters of the hot paths, compiled in only with -DROPE_COUNTERS
+// They tell whether slow edits come from deep trees, fragmented leaves or allocations:
+// read ropeCounters after a workload, and clear it with resetRopeCounters.
+// The counters are relaxed atomics, so threads of rebuildParallel count correctly.
+// Without ROPE_COUNTERS, ROPE_COUNT is empty and the hot paths are unchanged.
+#ifdef ROPE_COUNTERS
+struct ropeCounters {
+	atomic_llong nodesAllocated; // Nodes of the binary rope, malloc'd or from an arena
+	atomic_llong nodesFreed;
+	atomic_llong splits; // Calls of split
+	atomic_llong concats; // Calls of concat
+	atomic_llong leafSplits; // Calls of splitLeaf
+	atomic_llong descents; // Calls of gotoNode, kthChar included
+	atomic_llong descentSteps; // Edges walked by them, so descentSteps / descents is the mean depth
+	atomic_llong collectBytes; // Characters copied by collect
+	atomic_llong leafSplitBytes; // Characters copied by splitLeaf
+};
+
+struct ropeCounters ropeCounters;
+
+#define ROPE_COUNT(counter, n) atomic_fetch_add_explicit(&ropeCounters.counter, (n), memory_order_relaxed)
+
+void resetRopeCounters () {
+	memset(&ropeCounters, 0, sizeof(ropeCounters));
+}
+#else
+#define ROPE_COUNT(counter, n) ((void) 0)
+#endif
+
+// Counts a change of the rope in the version of its root, see ropeFinger
+// Functions that change the nodes of a rope count a change of it, so a finger that remembers an older
+// version may refer to changed or freed nodes and starts again from the root.  Only the rope itself
+// is touched, so the fingers of other ropes stay valid and threads that edit different ropes do not meet.
+// A root that replaces the root of a rope takes over its version.  The version wraps around only
+// after 2^32 changes, which a finger would have to miss exactly to be fooled
+void ropeChanged (struct node* const rope) {
+	rope->version++;
+}
+
 // Returns whether the rope contains any characters
 short isEmpty (const struct node* const r) {
 	return (r==NULL || r->left == NULL || r->leftLen==0) ? 1 : 0;
 }
 
-// Creates and initializes a new node
+// Returns the number of newline characters in length bytes of data
+// The bytes are compared 32 (AVX2) or 16 (SSE2) at a time, and the matches are summed in byte lanes
+// for at most 255 rounds before the lanes are added up, so that they do not overflow
+int countLines (const char* data, const int length) {
+	int lines = 0, k = 0;
+#if defined(__AVX2__)
+	const __m256i newline = _mm256_set1_epi8('\n');
+	while (length - k >= 32) {
+		__m256i sums = _mm256_setzero_si256();
+		int rounds = myMin((length - k) / 32, 255);
+		for (int r = 0; r < rounds; r++, k += 32)
+			sums = _mm256_sub_epi8(sums, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + k)), newline));
+		uint64_t parts[4];
+		_mm256_storeu_si256((__m256i*) parts, _mm256_sad_epu8(sums, _mm256_setzero_si256()));
+		lines += parts[0] + parts[1] + parts[2] + parts[3];
+	}
+#elif defined(__SSE2__)
+	const __m128i newline = _mm_set1_epi8('\n');
+	while (length - k >= 16) {
+		__m128i sums = _mm_setzero_si128();
+		int rounds = myMin((length - k) / 16, 255);
+		for (int r = 0; r < rounds; r++, k += 16)
+			sums = _mm_sub_epi8(sums, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + k)), newline));
+		sums = _mm_sad_epu8(sums, _mm_setzero_si128());
+		lines += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+	}
+#endif
+	for (; k < length; k++)
+		lines += (data[k] == '\n');
+	return lines;
+}
+
+// Returns the number of UTF-8 code points in length bytes of data, that is the bytes that are not 10xxxxxx
+// As signed bytes, continuation bytes are -128..-65, so the others are found with one signed comparison
+// and summed like in countLines
+int countCodePoints (const char* data, const int length) {
+	int codePoints = 0, k = 0;
+#if defined(__AVX2__)
+	const __m256i limit = _mm256_set1_epi8(-65);
+	while (length - k >= 32) {
+		__m256i sums = _mm256_setzero_si256();
+		int rounds = myMin((length - k) / 32, 255);
+		for (int r = 0; r < rounds; r++, k += 32)
+			sums = _mm256_sub_epi8(sums, _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i*) (data + k)), limit));
+		uint64_t parts[4];
+		_mm256_storeu_si256((__m256i*) parts, _mm256_sad_epu8(sums, _mm256_setzero_si256()));
+		codePoints += parts[0] + parts[1] + parts[2] + parts[3];
+	}
+#elif defined(__SSE2__)
+	const __m128i limit = _mm_set1_epi8(-65);
+	while (length - k >= 16) {
+		__m128i sums = _mm_setzero_si128();
+		int rounds = myMin((length - k) / 16, 255);
+		for (int r = 0; r < rounds; r++, k += 16)
+			sums = _mm_sub_epi8(sums, _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*) (data + k)), limit));
+		sums = _mm_sad_epu8(sums, _mm_setzero_si128());
+		codePoints += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+	}
+#endif
+	for (; k < length; k++)
+		codePoints += ((data[k] & 0xC0) != 0x80);
+	return codePoints;
+}
+
+// Returns where length bytes of data should be cut so that the last UTF-8 sequence is not cut in two:
+// the start of the last sequence if it continues after length, otherwise length
+// Only the last three bytes are looked at, so data that is not UTF-8 is cut at length
+int codePointBoundary (const char* data, const int length) {
+	for (int k = length - 1; k > 0 && k >= length - 3; k--) {
+		unsigned char b = data[k];
+		if ((b & 0xC0) == 0x80)
+			continue;
+		int sequence = (b >= 0xF0) ? 4 : (b >= 0xE0) ? 3 : (b >= 0xC0) ? 2 : 1;
+		return (k + sequence > length) ? k : length;
+	}
+	return length;
+}
+
+// Shared texts
+// A shared text is a read-only block of characters that leaves refer to instead of copying it,
+// for example a mapped file, so that opening a huge file neither copies it nor uses anonymous memory.
+// Each malloc'd leaf holds a reference to its text, while an arena holds one reference
+// for all of its leaves and releases it with the arena.
+struct sharedText {
+	char* base;
+	size_t length;
+	int refs;
+	short mapped; // Unmapped instead of freed when released
+	dev_t device; // File of a mapped text
+	ino_t inode;
+	struct ropeArena* heldBy; // Arena that holds a reference, if any
+};
+
+// Releases a reference to the shared text, and the text itself with the last reference
+void releaseText (struct sharedText* text) {
+	if (--text->refs > 0)
+		return;
+	if (text->mapped) {
+		if (text->length > 0)
+			munmap(text->base, text->length);
+	}
+	else
+		free (text->base);
+	free (text);
+}
+
+// Arena allocator
+// Nodes of an arena are carved from slabs aligned to ARENA_SLAB_SIZE, so the arena of a node
+// is found from the node address and nodes need no extra pointer.
+// Leaf data is one block per leaf, taken from power-of-two size classes of the arena
+// (freed blocks are reused by the same class) or malloc'd and tracked if larger than the largest class.
+// Non-leaf nodes of an arena have no data block at all.
+// Freeing the arena releases all its nodes and data at once, one free per slab or chunk.
+#define ARENA_SLAB_SIZE 65536
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_MIN_BLOCK 16 // Smallest data block, enough for the free list link
+#define ARENA_CLASSES 9 // Blocks of 16, 32, ... 4096 bytes
+#define ARENA_NO_TEXT 0xFF // textClass of a node without a data block
+#define ARENA_BIG_TEXT 0xFE // textClass of a data block bigger than the largest class
+
+enum NodeFlags {NODE_IN_ARENA = 1, NODE_OWNS_ARENA = 2, NODE_SHARED_TEXT = 4};
+
+struct arenaSlab {
+	struct ropeArena* arena;
+	struct arenaSlab* next;
+};
+
+struct bigBlock {
+	struct bigBlock* prev;
+	struct bigBlock* next;
+};
+
+struct ropeArena {
+	struct arenaSlab* slabs;
+	struct node* freeNodes; // Linked through the left pointer
+	long nodesTaken; // Nodes given out and not returned, which freeArena frees as a whole
+	char* chunks; // Data chunks, each starts with a pointer to the next one
+	char* bump; // Unused part of the newest chunk
+	size_t bumpLeft;
+	char* freeText[ARENA_CLASSES]; // Free blocks of each class, linked through their first bytes
+	struct bigBlock* big;
+	struct sharedText** texts; // Shared texts that the leaves of the arena refer to
+	int textCount;
+	int textCapacity;
+};
+
+// Creates an empty arena
+// Returns NULL if creation fails
+struct ropeArena* newArena() {
+	struct ropeArena* arena = calloc(1, sizeof(struct ropeArena));
+	if (arena == NULL)
+		currentError = ALLOC;
+	return arena;
+}
+
+// Frees the arena and every node and data block allocated from it
+void freeArena(struct ropeArena* arena) {
+	if (arena == NULL)
+		return;
+	while (arena->slabs != NULL) {
+		struct arenaSlab* next = arena->slabs->next;
+		free (arena->slabs);
+		arena->slabs = next;
+	}
+	while (arena->chunks != NULL) {
+		char* next = *(char**) arena->chunks;
+		free (arena->chunks);
+		arena->chunks = next;
+	}
+	while (arena->big != NULL) {
+		struct bigBlock* next = arena->big->next;
+		free (arena->big);
+		arena->big = next;
+	}
+	for (int k = 0; k < arena->textCount; k++) {
+		if (arena->texts[k]->heldBy == arena)
+			arena->texts[k]->heldBy = NULL;
+		releaseText(arena->texts[k]);
+	}
+	free (arena->texts);
+	free (arena);
+}
+
+// Returns the arena of the node, or NULL if the node has been malloc'd
+struct ropeArena* arenaOf(const struct node* const n) {
+	if (n == NULL || (n->flags & NODE_IN_ARENA) == 0)
+		return NULL;
+	return ((struct arenaSlab*) ((uintptr_t) n & ~(uintptr_t) (ARENA_SLAB_SIZE - 1)))->arena;
+}
+
+// Takes a node from the free list of the arena, or from a new slab if the list is empty
+struct node* arenaNode(struct ropeArena* arena) {
+	if (arena->freeNodes == NULL) {
+		struct arenaSlab* slab = aligned_alloc(ARENA_SLAB_SIZE, ARENA_SLAB_SIZE);
+		if (slab == NULL) {
+			currentError = ALLOC;
+			return NULL;
+		}
+		slab->arena = arena;
+		slab->next = arena->slabs;
+		arena->slabs = slab;
+		struct node* first = (struct node*) (slab + 1);
+		int count = (ARENA_SLAB_SIZE - sizeof(struct arenaSlab)) / sizeof(struct node);
+		for (int k = 0; k < count; k++) {
+			first[k].left = arena->freeNodes;
+			arena->freeNodes = first + k;
+		}
+	}
+	struct node* n = arena->freeNodes;
+	arena->freeNodes = n->left;
+	arena->nodesTaken++;
+	return n;
+}
+
+// Returns the size class of a data block that holds size bytes, or ARENA_BIG_TEXT
+unsigned char textClassOf(const int size) {
+	int blockSize = ARENA_MIN_BLOCK;
+	for (unsigned char c = 0; c < ARENA_CLASSES; c++, blockSize *= 2)
+		if (size <= blockSize)
+			return c;
+	return ARENA_BIG_TEXT;
+}
+
+// Allocates a data block of the given class from the arena, size is needed only for big blocks
+char* arenaText(struct ropeArena* arena, const unsigned char textClass, const int size) {
+	if (textClass == ARENA_BIG_TEXT) {
+		struct bigBlock* b = malloc(sizeof(struct bigBlock) + size);
+		if (b == NULL) {
+			currentError = ALLOC;
+			return NULL;
+		}
+		b->prev = NULL;
+		b->next = arena->big;
+		if (arena->big != NULL)
+			arena->big->prev = b;
+		arena->big = b;
+		return (char*) (b + 1);
+	}
+	char* block = arena->freeText[textClass];
+	if (block != NULL) {
+		arena->freeText[textClass] = *(char**) block;
+		return block;
+	}
+	size_t blockSize = (size_t) ARENA_MIN_BLOCK << textClass;
+	if (arena->bumpLeft < blockSize) { // Rest of the chunk is too small for the block and is left unused
+		char* chunk = malloc(ARENA_CHUNK_SIZE);
+		if (chunk == NULL) {
+			currentError = ALLOC;
+			return NULL;
+		}
+		*(char**) chunk = arena->chunks;
+		arena->chunks = chunk;
+		arena->bump = chunk + ARENA_MIN_BLOCK; // Keeps the blocks aligned
+		arena->bumpLeft = ARENA_CHUNK_SIZE - ARENA_MIN_BLOCK;
+	}
+	block = arena->bump;
+	arena->bump += blockSize;
+	arena->bumpLeft -= blockSize;
+	return block;
+}
+
+// Returns a data block to the arena
+void arenaFreeText(struct ropeArena* arena, char* block, const unsigned char textClass) {
+	if (textClass == ARENA_NO_TEXT)
+		return;
+	if (textClass == ARENA_BIG_TEXT) {
+		struct bigBlock* b = (struct bigBlock*) block - 1;
+		if (b->prev != NULL)
+			b->prev->next = b->next;
+		else
+			arena->big = b->next;
+		if (b->next != NULL)
+			b->next->prev = b->prev;
+		free (b);
+		return;
+	}
+	*(char**) block = arena->freeText[textClass];
+	arena->freeText[textClass] = block;
+}
+
+// Shrinks the big data block of a leaf in the arena to size bytes, like realloc
+// If shrinking fails, the leaf keeps its bigger block
+void arenaShrinkText(struct ropeArena* arena, struct node* const leaf, const int size) {
+	struct bigBlock* b = realloc((struct bigBlock*) leaf->data - 1, sizeof(struct bigBlock) + size);
+	if (b == NULL)
+		return;
+	if (b->prev != NULL) // The block may have moved
+		b->prev->next = b;
+	else
+		arena->big = b;
+	if (b->next != NULL)
+		b->next->prev = b;
+	leaf->data = (char*) (b + 1);
+	leaf->capacity = size;
+}
+
+// Creates and initializes a new node with room for dataSize characters
+// leftLen is set to dataSize, and data is NULL if dataSize is zero
 // Returns NULL if creation fails
 struct node* initNode(const int dataSize) {
 	struct node* n = malloc(sizeof(struct node));
 	if (n != NULL) {
 		n->left = NULL;
 		n->right = NULL;
-		n->leftLen = 0;
-		n->parent = NULL;
-		char* myData = malloc ((dataSize + 1) * sizeof(char));
+		n->leftLen = dataSize;
+		n->leftLines = 0; // Counted when the data is filled
+		n->leftChars = 0;
+		n->refs = 1;
+		n->flags = 0;
+		n->textClass = ARENA_NO_TEXT;
+		n->height = 0;
+		n->data = NULL;
+		n->capacity = dataSize;
+		if (dataSize > 0) {
+			n->data = malloc (dataSize * sizeof(char));
+			if (n->data == NULL) {
+				currentError = ALLOC;
+				free (n);
+				return NULL;
+			}
+		}
+		ROPE_COUNT(nodesAllocated, 1);
+	}
+	else currentError = ALLOC;
+	return n;
+}
+
+// Creates and initializes a new node
+// The node is allocated from the arena, or with malloc if arena is NULL
+// Returns NULL if creation fails
+struct node* initNodeIn(struct ropeArena* arena, const int dataSize) {
+	if (arena == NULL)
+		return initNode(dataSize);
+	struct node* n = arenaNode(arena);
+	if (n == NULL)
+		return NULL;
+	n->left = NULL;
+	n->right = NULL;
+	n->leftLen = dataSize;
+	n->leftLines = 0; // Counted when the data is filled
+	n->leftChars = 0;
+	n->refs = 1;
+	n->flags = NODE_IN_ARENA;
+	n->textClass = ARENA_NO_TEXT;
+	n->height = 0;
+	n->data = NULL;
+	n->capacity = dataSize;
+	if (dataSize > 0) {
+		unsigned char textClass = textClassOf(dataSize);
+		char* myData = arenaText(arena, textClass, dataSize);
 		if (myData == NULL) {
-			currentError = ALLOC;
-			free (n);
+			n->left = arena->freeNodes;
+			arena->freeNodes = n;
+			arena->nodesTaken--;
 			return NULL;
 		}
-		myData[dataSize] = '\0';
 		n->data = myData;
+		n->textClass = textClass;
+		if (textClass != ARENA_BIG_TEXT) // The whole block is room for the leaf
+			n->capacity = ARENA_MIN_BLOCK << textClass;
 	}
-	else currentError = ALLOC;
+	ROPE_COUNT(nodesAllocated, 1);
 	return n;
 }
 
-// Free a single node
+// Counts the newlines and code points of a leaf from its data
+void countLeaf (struct node* const leaf) {
+	leaf->leftLines = countLines(leaf->data, leaf->leftLen);
+	leaf->leftChars = countCodePoints(leaf->data, leaf->leftLen);
+}
+
+// Takes the reference of the leaf to the shared text: a malloc'd leaf holds one of its own,
+// and a leaf in an arena uses the one of the arena, which is taken the first time
+// Returns 0 if the arena cannot record the text
+short holdText (struct node* const leaf, struct sharedText* text) {
+	struct ropeArena* arena = arenaOf(leaf);
+	if (arena == NULL)
+		text->refs++;
+	else if (text->heldBy != arena) {
+		if (arena->textCount == arena->textCapacity) {
+			int capacity = arena->textCapacity == 0 ? 8 : 2 * arena->textCapacity;
+			struct sharedText** p = realloc(arena->texts, capacity * sizeof(struct sharedText*));
+			if (p == NULL) {
+				currentError = ALLOC;
+				return 0;
+			}
+			arena->texts = p;
+			arena->textCapacity = capacity;
+		}
+		arena->texts[arena->textCount++] = text;
+		text->refs++;
+		text->heldBy = arena;
+	}
+	return 1;
+}
+
+// Makes the leaf, which has no data of its own, refer to length characters of the shared text from data on
+// Returns 0 if the arena of the leaf cannot record the text, and then the leaf is unchanged
+short shareText (struct node* const leaf, struct sharedText* text, char* data, const int length) {
+	if (holdText(leaf, text) == 0)
+		return 0;
+	leaf->flags |= NODE_SHARED_TEXT;
+	leaf->text = text;
+	leaf->data = data;
+	leaf->leftLen = length;
+	countLeaf(leaf);
+	return 1;
+}
+
+// Returns 1 if the leaf has a malloc'd data block of its own with more than LEAF_MAX_SIZE characters,
+// such as the leaf of a long insert, so that the block can become a shared text
+// Leaves of an arena are not converted: the arena holds one reference for all of its leaves,
+// so the block would stay allocated until the arena is freed, long after its leaves are gone
+short isLongLeaf (const struct node* const leaf) {
+	return leaf->left == NULL && leaf->right == NULL && (leaf->flags & (NODE_SHARED_TEXT | NODE_IN_ARENA)) == 0
+	  && leaf->leftLen > LEAF_MAX_SIZE;
+}
+
+// Turns the data block of a long leaf into a shared text that the leaf refers to, without copying it,
+// so that splitting or copying the leaf later shares the block instead of copying characters
+// The text is freed with the last leaf that refers to it
+// Returns 0 if allocation fails, and then the leaf is unchanged
+// Precondition: isLongLeaf(leaf), and no other rope can see the leaf, because its flags change
+short shareOwnText (struct node* const leaf) {
+	struct sharedText* text = calloc(1, sizeof(struct sharedText));
+	if (text == NULL) {
+		currentError = ALLOC;
+		return 0;
+	}
+	text->base = leaf->data;
+	text->length = leaf->leftLen;
+	text->refs = 1; // The reference of the leaf
+	leaf->flags |= NODE_SHARED_TEXT;
+	leaf->text = text;
+	return 1;
+}
+
+// Creates an empty rope that owns a new arena
+// freeAll on the rope releases the whole arena at once, including
+// all the ropes split off from it and all copies made in the arena
+// Returns NULL if creation fails
+struct node* newArenaRope() {
+	struct ropeArena* arena = newArena();
+	if (arena == NULL)
+		return NULL;
+	struct node* rope = initNodeIn(arena, 0);
+	if (rope == NULL) {
+		freeArena(arena);
+		return NULL;
+	}
+	rope->flags |= NODE_OWNS_ARENA;
+	return rope;
+}
+
+// Moves the ownership of the arena from a root that is going to be freed to its replacement
+void handOverArena(struct node* const from, struct node* const to) {
+	if (from != to && to != NULL && (from->flags & NODE_OWNS_ARENA) != 0) {
+		from->flags &= ~NODE_OWNS_ARENA;
+		to->flags |= NODE_OWNS_ARENA;
+	}
+}
+
+// Free a single node, regardless of the references to it
 void freeNode (struct node* where) {
+	ROPE_COUNT(nodesFreed, 1);
+	if (where->flags & NODE_SHARED_TEXT) { // The data belongs to the text
+		if ((where->flags & NODE_IN_ARENA) == 0)
+			releaseText(where->text);
+		where->data = NULL;
+		where->textClass = ARENA_NO_TEXT;
+	}
+	if (where->flags & NODE_IN_ARENA) {
+		struct ropeArena* arena = arenaOf(where);
+		arenaFreeText(arena, where->data, where->textClass);
+		where->left = arena->freeNodes;
+		arena->freeNodes = where;
+		arena->nodesTaken--;
+		return;
+	}
 	if (where->data != NULL)
 		free (where->data);
 	free (where);
 }
 
 // Frees all nodes from node "where" on and included
+// Nodes that are shared with other ropes lose one reference and are freed only when the last one is gone
+// If "where" is a rope that owns its arena, the whole arena is released at once
+// The tree is walked without recursion: a node whose left subtree is being freed waits on a list
+// linked through its own left pointer, so any depth takes no stack and no allocations
 void freeAll(struct node* where) {
-	if (where != NULL) {
-		if (where->left != NULL)
-			freeAll(where->left);
-		if (where->right != NULL)
-			freeAll(where->right);
-		freeNode(where);
+	if (where != NULL && (where->flags & NODE_OWNS_ARENA) != 0) {
+		struct ropeArena* arena = arenaOf(where);
+		ROPE_COUNT(nodesFreed, arena->nodesTaken); // Freed with the arena, not one by one
+		freeArena(arena);
+		return;
+	}
+	if (where == NULL || --where->refs > 0)
+		return;
+	struct node* waiting = NULL; // Unreferenced nodes whose right subtree is still to be freed
+	struct node* n = where;
+	for (;;) {
+		while (n != NULL) { // Down the left edge, through the nodes that lose their last reference
+			struct node* left = n->left;
+			n->left = waiting;
+			waiting = n;
+			n = (left != NULL && --left->refs == 0) ? left : NULL;
+		}
+		if (waiting == NULL)
+			break;
+		n = waiting;
+		waiting = n->left;
+		struct node* right = n->right;
+		freeNode(n);
+		n = (right != NULL && --right->refs == 0) ? right : NULL;
+	}
+}
+
+// Returns a node that the caller may change: the node itself if it is not shared,
+// or otherwise a copy of it that shares the subtrees, and then the node loses the reference of the caller
+// Calls errorOccurred if the copy cannot be allocated
+struct node* own (struct node* const n) {
+	if (n->refs == 1)
+		return n;
+	short ownData = (n->left == NULL && n->right == NULL && (n->flags & NODE_SHARED_TEXT) == 0);
+	struct node* copy = initNodeIn(arenaOf(n), ownData ? n->leftLen : 0);
+	if (copy == NULL || ((n->flags & NODE_SHARED_TEXT) && shareText(copy, n->text, n->data, n->leftLen) == 0))
+		errorOccurred();
+	copy->leftLen = n->leftLen;
+	copy->leftLines = n->leftLines;
+	copy->leftChars = n->leftChars;
+	copy->height = n->height;
+	copy->left = n->left;
+	copy->right = n->right;
+	if (copy->left != NULL)
+		copy->left->refs++;
+	if (copy->right != NULL)
+		copy->right->refs++;
+	if (ownData && n->data != NULL)
+		memcpy(copy->data, n->data, n->leftLen);
+	n->refs--;
+	return copy;
+}
+
+// Returns a snapshot of the rope in constant time: a new root that shares the whole tree with the rope
+// Changing the rope or the snapshot later copies only the nodes on the changed paths, so neither sees
+// the changes of the other.  Snapshots are freed with freeAll
+// A snapshot of a rope that owns its arena is released with the arena
+struct node* snapshot (struct node* rope) {
+	if (rope == NULL) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct node* copy = initNodeIn(arenaOf(rope), 0);
+	if (copy == NULL)
+		return NULL;
+	ropeChanged(rope); // The nodes of the rope are shared from now on, see ropeExtend
+	copy->leftLen = rope->leftLen;
+	copy->leftLines = rope->leftLines;
+	copy->leftChars = rope->leftChars;
+	copy->height = rope->height;
+	copy->left = rope->left;
+	if (copy->left != NULL)
+		copy->left->refs++;
+	return copy;
+}
+
+// Shared document: one writer and many reader threads
+// Readers read the published rope without locks and never wait for the writer.
+// The writer edits a snapshot of the published rope and publishes it with an atomic swap,
+// so the readers see either the old or the new version, never a half-made one.
+// The replaced version is retired and freed only after every reader that may still see it has left,
+// which is known from the epochs that the readers announce (epoch-based reclamation).
+// Only the writer changes the reference counts and allocates or frees nodes, the readers only read.
+#define ROPE_MAX_READERS 64
+
+struct retiredRope {
+	struct node* rope;
+	unsigned long epoch; // Epoch in which the rope was replaced
+	struct retiredRope* next;
+};
+
+struct ropeDocument {
+	_Atomic(struct node*) rope; // Published rope
+	atomic_ulong epoch; // Current epoch, starts from one
+	atomic_ulong readers[ROPE_MAX_READERS]; // Epoch announced by each reader, zero if it is not reading
+	atomic_int slotTaken[ROPE_MAX_READERS];
+	struct retiredRope* retired; // Used by the writer only
+};
+
+// Creates a document that publishes the rope, the document takes the ownership of the rope
+// Returns NULL if creation fails
+struct ropeDocument* newDocument (struct node* rope) {
+	if (rope == NULL) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct ropeDocument* doc = calloc(1, sizeof(struct ropeDocument));
+	if (doc == NULL) {
+		currentError = ALLOC;
+		return NULL;
+	}
+	atomic_init(&doc->rope, rope);
+	atomic_init(&doc->epoch, 1);
+	for (int k = 0; k < ROPE_MAX_READERS; k++) {
+		atomic_init(&doc->readers[k], 0);
+		atomic_init(&doc->slotTaken[k], 0);
+	}
+	return doc;
+}
+
+// Reserves a reader slot for the calling thread, the slot is used with readBegin and readEnd
+// Returns the slot, or -1 if all ROPE_MAX_READERS slots are taken
+int readerSlot (struct ropeDocument* doc) {
+	if (doc == NULL) {
+		currentError = PARAM;
+		return -1;
+	}
+	for (int k = 0; k < ROPE_MAX_READERS; k++) {
+		int expected = 0;
+		if (atomic_compare_exchange_strong(&doc->slotTaken[k], &expected, 1))
+			return k;
+	}
+	currentError = PARAM;
+	return -1;
+}
+
+// Gives the reader slot back, the reader must not be reading
+void releaseReaderSlot (struct ropeDocument* doc, const int slot) {
+	atomic_store(&doc->readers[slot], 0);
+	atomic_store(&doc->slotTaken[slot], 0);
+}
+
+// Starts reading the document and returns the published rope
+// The rope may be read with collect, kthChar, collectSpans and cursors until readEnd,
+// but it must not be changed or snapshotted by the reader
+struct node* readBegin (struct ropeDocument* doc, const int slot) {
+	atomic_store(&doc->readers[slot], atomic_load(&doc->epoch)); // Announce before looking at the rope
+	return atomic_load(&doc->rope);
+}
+
+// Ends reading, the rope returned by readBegin may be freed after this
+void readEnd (struct ropeDocument* doc, const int slot) {
+	atomic_store_explicit(&doc->readers[slot], 0, memory_order_release);
+}
+
+// Returns a private version of the published rope for the writer to change and publish
+// Only the nodes that the writer changes are copied, see snapshot
+struct node* writeBegin (struct ropeDocument* doc) {
+	if (doc == NULL) {
+		currentError = PARAM;
+		return NULL;
+	}
+	return snapshot(atomic_load(&doc->rope));
+}
+
+// Frees the retired ropes that no reader can see any more
+// A rope retired in epoch e is seen only by readers that announced e or an earlier epoch
+void reclaimRetired (struct ropeDocument* doc) {
+	unsigned long oldest = atomic_load(&doc->epoch);
+	for (int k = 0; k < ROPE_MAX_READERS; k++) {
+		unsigned long announced = atomic_load(&doc->readers[k]);
+		if (announced != 0 && announced < oldest)
+			oldest = announced;
+	}
+	struct retiredRope** link = &doc->retired;
+	while (*link != NULL) {
+		struct retiredRope* r = *link;
+		if (r->epoch < oldest) {
+			*link = r->next;
+			freeAll(r->rope);
+			free (r);
+		}
+		else
+			link = &r->next;
+	}
+}
+
+// Publishes the version of the writer, which then belongs to the document
+// The replaced version is freed when the readers have left it
+// Returns 1 on success and 0 if the old version cannot be retired, and then nothing is published
+short publish (struct ropeDocument* doc, struct node* rope) {
+	if (doc == NULL || rope == NULL) {
+		currentError = PARAM;
+		return 0;
+	}
+	struct retiredRope* r = malloc(sizeof(struct retiredRope));
+	if (r == NULL) {
+		currentError = ALLOC;
+		return 0;
+	}
+	struct node* old = atomic_load(&doc->rope);
+	handOverArena(old, rope); // Ownership moves before the swap, the old version is freed node by node
+	atomic_store(&doc->rope, rope);
+	r->rope = old;
+	r->epoch = atomic_fetch_add(&doc->epoch, 1);
+	r->next = doc->retired;
+	doc->retired = r;
+	reclaimRetired(doc);
+	return 1;
+}
+
+// Frees the document and all versions of its rope
+// No reader may be reading
+void freeDocument (struct ropeDocument* doc) {
+	if (doc == NULL)
+		return;
+	while (doc->retired != NULL) {
+		struct retiredRope* next = doc->retired->next;
+		freeAll(doc->retired->rope);
+		free (doc->retired);
+		doc->retired = next;
+	}
+	freeAll(atomic_load(&doc->rope));
+	free (doc);
+}
+
+// Makes room for need characters in a leaf that is not shared
+// The room is at least doubled, up to LEAF_MAX_SIZE, so that a leaf that is typed into is not reallocated for every character
+// Returns 0 if allocation fails, and then the leaf is unchanged
+// A leaf with a shared text gets a data block of its own here
+short growLeaf (struct node* const leaf, const int need) {
+	short shared = (leaf->flags & NODE_SHARED_TEXT) != 0;
+	if (!shared && need <= leaf->capacity)
+		return 1;
+	int capacity = shared ? need : myMin(2 * leaf->capacity, LEAF_MAX_SIZE);
+	if (capacity < need)
+		capacity = need;
+	if (shared) {
+		struct node* copy = initNodeIn(arenaOf(leaf), capacity); // Only for its data block
+		if (copy == NULL)
+			return 0;
+		memcpy(copy->data, leaf->data, leaf->leftLen);
+		if ((leaf->flags & NODE_IN_ARENA) == 0)
+			releaseText(leaf->text);
+		leaf->flags &= ~NODE_SHARED_TEXT;
+		leaf->data = copy->data;
+		leaf->textClass = copy->textClass;
+		leaf->capacity = copy->capacity;
+		copy->data = NULL;
+		copy->textClass = ARENA_NO_TEXT;
+		freeNode(copy);
+		return 1;
+	}
+	if (leaf->flags & NODE_IN_ARENA) {
+		struct ropeArena* arena = arenaOf(leaf);
+		unsigned char textClass = textClassOf(capacity);
+		char* block = arenaText(arena, textClass, capacity);
+		if (block == NULL)
+			return 0;
+		if (leaf->leftLen > 0)
+			memcpy(block, leaf->data, leaf->leftLen);
+		arenaFreeText(arena, leaf->data, leaf->textClass);
+		leaf->data = block;
+		leaf->textClass = textClass;
+		leaf->capacity = (textClass == ARENA_BIG_TEXT) ? capacity : ARENA_MIN_BLOCK << textClass;
+		return 1;
 	}
+	char* p = realloc (leaf->data, capacity * sizeof(char));
+	if (p == NULL) {
+		currentError = ALLOC;
+		return 0;
+	}
+	leaf->data = p;
+	leaf->capacity = capacity;
+	return 1;
 }
 
 // Splits the leaf node in two
 // Takes characters from position pos to the end out of the leaf and moves them into a new leaf
-// The new leaf has NULL parent
+// A long malloc'd leaf is not copied: both parts refer to its block as a shared text, see shareOwnText,
+// and only the newlines and code points of the shorter part are counted.  A part shorter than
+// LEAF_MIN_SIZE gets a copy of its own, so that small fragments do not keep a big text alive
+// Precondition: the leaf is not shared
 // Returns a pointer to the new leaf
 // And moves the characters as a side effect
-// Does not update leaf's parent's leftLen even when leaf is a left child
+// Updates leftLen of the leaf, but does not update leaf's parent's leftLen even when leaf is a left child
 // and does not update leftLen-variables of any ancestors
-// Precondition: original leaf data must contain at least the NULL character
 struct node* splitLeaf (struct node* const leaf, const int pos) {
 	if (leaf==NULL || pos < 0) { // Erroneous parameters, no splitting
 		currentError = PARAM;
 		return NULL;
 	}
-	size_t totalLen = strlen(leaf->data);
-	if (totalLen < 0 || pos > totalLen) { // Error, no splitting
+	int totalLen = leaf->leftLen;
+	if (pos > totalLen) { // Error, no splitting
 		currentError = PARAM;
 		return NULL;
 	}
 	
+	ROPE_COUNT(leafSplits, 1);
 	int newNodeSize = totalLen - pos;
 	struct node* newNode = NULL;
-	newNode = initNode(newNodeSize);
+	if (isLongLeaf(leaf) && shareOwnText(leaf) == 0)
+		goto splitLeafError;
+	if (leaf->flags & NODE_SHARED_TEXT) { // Both parts refer to the same text, nothing is copied
+		newNode = initNodeIn(arenaOf(leaf), 0);
+		if (newNode == NULL || holdText(newNode, leaf->text) == 0)
+			goto splitLeafError;
+		newNode->flags |= NODE_SHARED_TEXT;
+		newNode->text = leaf->text;
+		newNode->data = leaf->data + pos;
+		newNode->leftLen = newNodeSize;
+		if (pos < newNodeSize) {
+			newNode->leftLines = leaf->leftLines - countLines(leaf->data, pos);
+			newNode->leftChars = leaf->leftChars - countCodePoints(leaf->data, pos);
+		}
+		else
+			countLeaf(newNode);
+		if (newNodeSize > 0 && newNodeSize < LEAF_MIN_SIZE) {
+			if (growLeaf(newNode, newNodeSize) == 0)
+				goto splitLeafError;
+			ROPE_COUNT(leafSplitBytes, newNodeSize);
+		}
+		leaf->leftLen = pos;
+		leaf->leftLines -= newNode->leftLines;
+		leaf->leftChars -= newNode->leftChars;
+		if (pos > 0 && pos < LEAF_MIN_SIZE) {
+			if (growLeaf(leaf, pos) == 0) {
+				leaf->leftLen = totalLen;
+				leaf->leftLines += newNode->leftLines;
+				leaf->leftChars += newNode->leftChars;
+				goto splitLeafError;
+			}
+			ROPE_COUNT(leafSplitBytes, pos);
+		}
+		return newNode;
+	}
+	newNode = initNodeIn(arenaOf(leaf), newNodeSize);
 	if (newNode == NULL) {
 		goto splitLeafError;
 	}
 	
-	strcpy(newNode->data, leaf->data + pos);
+	if (newNodeSize > 0)
+		memcpy(newNode->data, leaf->data + pos, newNodeSize);
+	ROPE_COUNT(leafSplitBytes, newNodeSize);
+	countLeaf(newNode);
+	leaf->leftLen = pos;
+	leaf->leftLines -= newNode->leftLines;
+	leaf->leftChars -= newNode->leftChars;
 	
-	char* p = realloc (leaf->data, (pos+1) * sizeof(char)); // Terminal NULL included
-	if (p == NULL) {
-		free (leaf->data); // To prevent the leak if realloc fails
-		goto splitLeafError;
+	if (leaf->flags & NODE_IN_ARENA) { // Only big blocks are shrunk, a class block is small anyway
+		if (leaf->textClass == ARENA_BIG_TEXT)
+			arenaShrinkText(arenaOf(leaf), leaf, pos);
+		return newNode;
+	}
+	if (pos == 0) {
+		free (leaf->data);
+		leaf->data = NULL;
+		leaf->capacity = 0;
+		return newNode;
+	}
+	char* p = realloc (leaf->data, pos * sizeof(char));
+	if (p != NULL) { // If shrinking fails, the leaf keeps its bigger block
+		leaf->data = p;
+		leaf->capacity = pos;
 	}
-	leaf->data = p;
-	leaf->data[pos] = '\0';
 
 	return newNode;
 
 	splitLeafError:
 	if (newNode != NULL)
-		free (newNode);
+		freeNode (newNode);
 	currentError = ALLOC;
 	return NULL;
 }
 
 // Calculates the length of a subtree rooted at pnode.
-// Precondition: if pnode is not NULL, it has at least the terminal NULL as data
-int countLength (const struct node* const pnode) {
-	int result = 0;
-	if (pnode!=NULL) {
-		if (pnode->left==NULL && pnode->right==NULL) {
-			result = strlen(pnode->data);
+// leftLen covers the left subtree, so only the right edge is walked
+ropeSize countLength (const struct node* pnode) {
+	ropeSize result = 0;
+	for (; pnode != NULL; pnode = pnode->right)
+		if (pnode->left != NULL || pnode->right == NULL) // Inner node with a left subtree, or leaf
+			result += pnode->leftLen;
+	return result;
+}
+
+// Shape of a rope, see ropeStats
+#define ROPE_HISTOGRAM_SIZE 32
+
+struct ropeStats {
+	ropeSize length; // Number of characters
+	int depth; // Number of edges on the longest path from the root to a leaf
+	int nodes; // Number of nodes, the root included
+	int leaves;
+	int sharedLeaves; // Leaves that refer to a shared text
+	int leafSizes[ROPE_HISTOGRAM_SIZE]; // Leaves of 0, 1, 2-3, 4-7, ... characters: k > 0 counts 2^(k-1) to 2^k - 1
+};
+
+// Adds the nodes of the subtree to the stats, depth is the depth of pnode
+void statsOf (const struct node* const pnode, const int depth, struct ropeStats* const stats) {
+	if (pnode == NULL)
+		return;
+	stats->nodes++;
+	if (depth > stats->depth)
+		stats->depth = depth;
+	if (pnode->left == NULL && pnode->right == NULL) {
+		if (depth > 0) { // Root of an empty rope is not a leaf
+			stats->leaves++;
+			if (pnode->flags & NODE_SHARED_TEXT)
+				stats->sharedLeaves++;
+			int k = 0;
+			while ((pnode->leftLen >> k) > 0)
+				k++;
+			stats->leafSizes[k]++;
 		}
-		else {
-			if (pnode->left != NULL)
-				result = pnode->leftLen;
-			if (pnode->right != NULL)
-				result += countLength(pnode->right);
+		return;
+	}
+	statsOf(pnode->left, depth + 1, stats);
+	statsOf(pnode->right, depth + 1, stats);
+}
+
+// Fills stats with the length, depth and size of the rope, and a histogram of the leaf sizes
+// Walks the whole tree, so it is meant for monitoring and testing the balance and fragmentation
+void ropeStats (const struct node* const rope, struct ropeStats* const stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (rope == NULL)
+		return;
+	stats->length = rope->leftLen;
+	statsOf(rope, 0, stats);
+}
+
+// Returns the height of a subtree, -1 for an empty subtree
+int heightOf (const struct node* const n) {
+	return (n == NULL) ? -1 : n->height;
+}
+
+// Sets the height of a node from the heights of its subtrees
+void updateHeight (struct node* const n) {
+	int l = heightOf(n->left), r = heightOf(n->right);
+	n->height = 1 + ((l > r) ? l : r);
+	if (n->left == NULL && n->right == NULL)
+		n->height = 0;
+}
+
+// Rotates the subtree right, so that the left child becomes the root of the subtree
+// leftLen of the moved nodes is kept consistent, and shared nodes are copied before they are changed
+// Returns the new root of the subtree
+struct node* rotateRight (struct node* x) {
+	x = own(x);
+	struct node* y = own(x->left);
+	x->left = y->right;
+	x->leftLen -= y->leftLen; // Left of x is now the right subtree of y
+	x->leftLines -= y->leftLines;
+	x->leftChars -= y->leftChars;
+	y->right = x;
+	updateHeight(x);
+	updateHeight(y);
+	return y;
+}
+
+// Rotates the subtree left, so that the right child becomes the root of the subtree
+// leftLen of the moved nodes is kept consistent, and shared nodes are copied before they are changed
+// Returns the new root of the subtree
+struct node* rotateLeft (struct node* x) {
+	x = own(x);
+	struct node* y = own(x->right);
+	x->right = y->left;
+	y->leftLen += x->leftLen; // Left of y is now x with both of its subtrees
+	y->leftLines += x->leftLines;
+	y->leftChars += x->leftChars;
+	y->left = x;
+	updateHeight(x);
+	updateHeight(y);
+	return y;
+}
+
+// Restores the AVL invariant of a node whose subtrees are balanced and differ in height at most by two
+// Precondition: n is not shared
+// Returns the new root of the subtree
+struct node* rebalance (struct node* const n) {
+	int balance = heightOf(n->left) - heightOf(n->right);
+	if (balance > 1) {
+		if (heightOf(n->left->left) < heightOf(n->left->right))
+			n->left = rotateLeft(n->left);
+		return rotateRight(n);
+	}
+	if (balance < -1) {
+		if (heightOf(n->right->right) < heightOf(n->right->left))
+			n->right = rotateRight(n->right);
+		return rotateLeft(n);
+	}
+	updateHeight(n);
+	return n;
+}
+
+// Returns the number of newlines in the subtree, which are on the right edge of the subtree
+ropeSize subtreeLines (const struct node* n) {
+	ropeSize lines = 0;
+	for (; n != NULL; n = n->right)
+		lines += n->leftLines;
+	return lines;
+}
+
+// Returns the number of code points in the subtree, like subtreeLines
+ropeSize subtreeChars (const struct node* n) {
+	ropeSize chars = 0;
+	for (; n != NULL; n = n->right)
+		chars += n->leftChars;
+	return chars;
+}
+
+// Makes n the parent of left and right, left has lSize characters, lLines newlines and lChars code points
+struct node* attach (struct node* const n, struct node* const left, struct node* const right, const ropeSize lSize, const ropeSize lLines, const ropeSize lChars) {
+	n->left = left;
+	n->right = right;
+	n->leftLen = lSize;
+	n->leftLines = lLines;
+	n->leftChars = lChars;
+	updateHeight(n);
+	return n;
+}
+
+// Joins left and right when left is higher, by descending the right edge of left
+// to a subtree that is at most one higher than right
+struct node* joinRight (struct node* left, struct node* const right, const ropeSize lSize, const ropeSize lLines, const ropeSize lChars, struct node* const n) {
+	if (heightOf(left) <= heightOf(right) + 1)
+		return attach(n, left, right, lSize, lLines, lChars);
+	left = own(left);
+	left->right = joinRight(left->right, right, lSize - left->leftLen, lLines - left->leftLines, lChars - left->leftChars, n);
+	return rebalance(left);
+}
+
+// Joins left and right when right is higher, by descending the left edge of right
+// to a subtree that is at most one higher than left
+struct node* joinLeft (struct node* const left, struct node* right, const ropeSize lSize, const ropeSize lLines, const ropeSize lChars, struct node* const n) {
+	if (heightOf(right) <= heightOf(left) + 1)
+		return attach(n, left, right, lSize, lLines, lChars);
+	right = own(right);
+	right->left = joinLeft(left, right->left, lSize, lLines, lChars, n);
+	right->leftLen += lSize;
+	right->leftLines += lLines;
+	right->leftChars += lChars;
+	return rebalance(right);
+}
+
+// Joins two balanced subtrees into one balanced subtree that has the characters of left before those of right
+// lSize is the number of characters in left, lLines the number of newlines and lChars the number of code points in it
+// n is an unused node that becomes the new internal node, it is freed if either subtree is empty
+// Takes time proportional to the difference of the heights, and allocates only to copy shared nodes
+// The references of the caller to left, right and n are taken over by the returned subtree
+struct node* joinWith (struct node* const left, struct node* const right, const ropeSize lSize, const ropeSize lLines, const ropeSize lChars, struct node* const n) {
+	if (left == NULL || right == NULL) {
+		freeNode(n);
+		return (left != NULL) ? left : right;
+	}
+	else if (heightOf(left) > heightOf(right) + 1)
+		return joinRight(left, right, lSize, lLines, lChars, n);
+	else if (heightOf(right) > heightOf(left) + 1)
+		return joinLeft(left, right, lSize, lLines, lChars, n);
+	return attach(n, left, right, lSize, lLines, lChars);
+}
+
+// Splits the subtree t in two so that *leftPart gets the characters before position and *rightPart the rest
+// Position must be less than the length of t
+// Like a join-based AVL split: the subtrees hanging off the path to the split leaf are joined back
+// on ascent, and the nodes of the path are reused as the joining nodes
+// The reference of the caller to t is taken over by the parts.  Shared nodes on the path are copied,
+// so an unshared tree is split without allocations except the one in splitLeaf
+// *leftLines and *leftChars are set to the number of newlines and code points in the left part
+// Returns 0 if the leaf cannot be split, and then t is unchanged
+int splitTree (struct node* t, const ropeSize position, struct node** leftPart, struct node** rightPart, ropeSize* leftLines, ropeSize* leftChars) {
+	struct node* original = t;
+	if (t->left == NULL && t->right == NULL) { // Now we are at data node
+		if (position == 0) { // No need to split, the leaf goes to the right part as a whole
+			*leftPart = NULL;
+			*rightPart = t;
+			*leftLines = 0;
+			*leftChars = 0;
+			return 1;
 		}
+		t = own(t);
+		struct node* tail = splitLeaf(t, position);
+		if (tail == NULL)
+			goto splitTreeError;
+		*leftPart = t;
+		*rightPart = tail;
+		*leftLines = t->leftLines;
+		*leftChars = t->leftChars;
+		return 1;
 	}
-	return result;
-		
+	t = own(t);
+	// Left or right decision by comparing position to leftLen
+	struct node* left = t->left, * right = t->right;
+	ropeSize leftLen = t->leftLen, lines = t->leftLines, chars = t->leftChars;
+	struct node* lower;
+	if (position < leftLen) { // Going left, the right subtree goes to the right part
+		if (splitTree(left, position, leftPart, &lower, leftLines, leftChars) == 0)
+			goto splitTreeError;
+		*rightPart = joinWith(lower, right, leftLen - position, lines - *leftLines, chars - *leftChars, t);
+	}
+	else { // Going right, the left subtree stays in the left part
+		ropeSize lowerLines, lowerChars;
+		if (splitTree(right, position - leftLen, &lower, rightPart, &lowerLines, &lowerChars) == 0)
+			goto splitTreeError;
+		*leftPart = joinWith(left, lower, leftLen, lines, chars, t);
+		*leftLines = lines + lowerLines;
+		*leftChars = chars + lowerChars;
+	}
+	return 1;
+
+	splitTreeError:
+	if (t != original) { // Drop the copy, the caller still refers to the original
+		original->refs++;
+		freeAll(t);
+	}
+	return 0;
 }
 
-// Rope split as in wikipedia.  Here is an implementation that is logarithmic if the tree is balanced.
+// Rope split as in wikipedia.  Here is an implementation that is logarithmic because the tree is kept balanced.
 // split splits an input rope in two.  As a side effect, the first rope contains data until the given position
 // and the output rope contains the rest of the data
 // Position starts from zero, and position is the first index of the data that is transferred to output rope
 // Wikipedia version does not remove an intermediate node (no root or leaf) if it has only one child
-// Removing those nodes would make the rope simpler and more balanced
-struct node* split (struct node* rope, int position) {
+// Here those nodes are removed, and both ropes are rebalanced by joining the detached subtrees on ascent
+// The original rope is preserved if some allocation fails
+// If the rope shares nodes with a snapshot, the shared nodes on the path are copied and the snapshot is unchanged
+struct node* split (struct node* rope, ropeSize position) {
 	if (rope == NULL || position < 0) {
 		currentError = PARAM;
 		return rope;
 	}
-	int currentLength = rope->leftLen; // Length of the original rope
+	ropeSize currentLength = rope->leftLen; // Length of the original rope
 	if (position >= currentLength) {
 		currentError = PARAM;
 		return rope;
 	}
-	int unsplit;
+	ROPE_COUNT(splits, 1);
+	ropeChanged(rope);
 	// First, newtree is a new rope: 
-	struct node* newtree = initNode(0);
+	struct node* newtree = initNodeIn(arenaOf(rope), 0);
 	if (newtree == NULL)  {// Cannot allocate nodes, cannot split
 		currentError = ALLOC;
 		return rope;
 	}
-	struct node* currentNew = newtree;
-	struct node* currentOrig = rope;
-
-	// To descend
-	while (currentOrig->left != NULL || currentOrig->right != NULL) {
-		 // Left or right decision by comparing position to leftLen
-		 if (position < currentOrig->leftLen) { // Going left
-			 if (currentOrig->right != NULL)
-			 {
-				 // Use root's left node, which has been created when the rope was initialized
-				 struct node* newLeft = initNode(0);
-				 if (newLeft == NULL) { // If node allocation fails, split fails
-					 freeAll(newtree);
-					 currentError = ALLOC;
-					 return NULL;
-				 }
-				 newLeft->right = currentOrig->right; // Right tree to be removed on ascent
-				 currentOrig->right->parent = newLeft;
-				 newLeft->parent = currentNew;
-				 currentNew->leftLen = currentLength - currentOrig->leftLen; // Correct this (add the rest) when the tree is ready by going upwards
-				 //  Not here, only on ascent currentOrig.right = NULL; // Remove from the original rope
-				 currentNew->left = newLeft;
-				 currentNew = currentNew->left;
-			 }
-			 currentLength = currentOrig->leftLen;
-			 currentOrig = currentOrig->left;
-		 }
-		 else { // Going right
-			position -= currentOrig->leftLen;
-			currentLength -= currentOrig->leftLen;
-			currentOrig = currentOrig->right;
-		 }
-	}
-	
-	short splitMe = 1;
-	// Now we are at data node
-	// split it at the position
-	int origNumOfChars = strlen(currentOrig->data);
-	unsplit = origNumOfChars;
-	struct node* newLeft = splitLeaf(currentOrig, position);
-	if (currentError == OK) {
-		newLeft->parent = currentNew;
-		currentNew->left = newLeft;
-		currentNew->leftLen = origNumOfChars - position;
-		if (currentOrig->parent != NULL &&
-		  currentOrig->parent->right == currentOrig)
-			splitMe = 0; // If I am right leaf, do not remove me
-		unsplit = position;
-	}
-	else { // splitLeaf fails, e.g. malloc fails
+	struct node* leftPart, * rightPart;
+	ropeSize leftLines, leftChars;
+	if (splitTree(rope->left, position, &leftPart, &rightPart, &leftLines, &leftChars) == 0) { // splitLeaf fails, e.g. malloc fails
+		freeNode(newtree);
 		return NULL;
 	}
-	
-	// To ascend and update the leftLen-fields of the path nodes in the original rope
-	// Make changes only here, so that the original rope is preserved if some allocation fails
-	while (currentOrig != rope) {
-		if (currentOrig->parent->left == currentOrig) { // I am left
-			currentOrig->parent->leftLen = unsplit;
-			if (splitMe == 1) {
-				currentOrig->parent->right = NULL; // Remove here the right subtrees on the path
-			}
-		}
-		else { // I am right
-			unsplit += currentOrig->parent->leftLen;
-		}
-		currentOrig = currentOrig->parent;
-		splitMe = 1;
-	}
-	
-	// Correct the leftlengths of the new tree
-	int cumLen = 0;
-	while (currentNew != newtree) {
-		currentNew->leftLen += cumLen;
-		cumLen = currentNew->leftLen;
-		currentNew = currentNew->parent;
-	}
-	currentNew->leftLen += cumLen;
-	
+	rope->left = leftPart;
+	rope->leftLen = position;
+	newtree->leftLines = rope->leftLines - leftLines;
+	newtree->leftChars = rope->leftChars - leftChars;
+	rope->leftLines = leftLines;
+	rope->leftChars = leftChars;
+	updateHeight(rope);
+	newtree->left = rightPart;
+	newtree->leftLen = currentLength - position;
+	updateHeight(newtree);
 	return newtree;
 }
 
-// Returns the kth character, or NULL if the character does not exist or an error occurs
+// Finds the node and index (starts from zero) in the node of the kth character in 
+//   a subtree starting from pFrom, and writes them into *loc, which the caller provides
 // k is the index, starting from zero
+// Descends in a loop, so a tree of any depth takes no stack, and nothing is allocated
+// Returns 1 on success and 0 if the character does not exist
 // Precondition: leftlen is the real length of the left subtree
-char kthChar (struct node* from, int k) {
-	if (from == NULL || k < 0) {
+short gotoNode (struct node* pFrom, ropeSize k, struct location* loc) {
+	if (pFrom == NULL || k < 0 || loc == NULL) {
 		currentError = PARAM;
-		return '\0';
+		return 0;
 	}
-	if (from->left == NULL && from->right == NULL) { // leaf, return data
-		if (from->data == NULL) {
-			currentError = INTERNAL;
-			return '\0';
+	ROPE_COUNT(descents, 1);
+	while (pFrom->left != NULL || pFrom->right != NULL) {
+		ROPE_COUNT(descentSteps, 1);
+		if (k < pFrom->leftLen)
+			pFrom = pFrom->left;
+		else {
+			k -= pFrom->leftLen;
+			pFrom = pFrom->right;
 		}
-		else if (strlen(from->data) <= k) { // length + index from zero offset
+		if (pFrom == NULL) { // Past the end of the rope
 			currentError = PARAM;
-			return '\0';
+			return 0;
 		}
-		else return from->data[k]; // from zero
 	}
-	if (k < from->leftLen)
-		return kthChar(from->left, k);
-	else
-		return kthChar(from->right, k - from->leftLen);
+	if (pFrom->leftLen <= k) { // length + index from zero offset
+		currentError = PARAM;
+		return 0;
+	}
+	if (pFrom->data == NULL) {
+		currentError = INTERNAL;
+		return 0; // Required data does not exist
+	}
+	loc->myNode = pFrom;
+	loc->myIndex = k;
+	return 1;
 }
 
-// Returns the node and index (starts from zero) in the node of the kth character in 
-//   a subtree starting from pFrom.
+// Returns the kth character, or NULL if the character does not exist or an error occurs
 // k is the index, starting from zero
 // Precondition: leftlen is the real length of the left subtree
-struct location* gotoNode (struct node* pFrom, int k) {
-	if (pFrom == NULL || k < 0) {
-		if (currentError != INTERNAL)
-			currentError = PARAM;
-		return NULL;
+char kthChar (struct node* from, ropeSize k) {
+	struct location loc;
+	if (gotoNode(from, k, &loc) == 0)
+		return '\0';
+	return loc.myNode->data[loc.myIndex]; // from zero
+}
+
+// Returns the index of the first character of a line, both starting from zero
+// Line k starts after the kth newline, so the lines are found by descending on leftLines like on leftLen
+// Returns -1 if the rope has fewer lines
+ropeSize lineToOffset (struct node* rope, ropeSize line) {
+	if (rope == NULL || line < 0 || line > rope->leftLines) {
+		currentError = PARAM;
+		return -1;
 	}
-	if (pFrom->left == NULL && pFrom->right == NULL) { // leaf, return from data
-		if (pFrom->data == NULL || strlen(pFrom->data) <= k) {
-			currentError = INTERNAL;
-			return NULL; // Required data does not exist
+	if (line == 0)
+		return 0;
+	struct node* n = rope->left;
+	ropeSize offset = 0;
+	while (n->left != NULL || n->right != NULL) {
+		if (line <= n->leftLines)
+			n = n->left;
+		else {
+			line -= n->leftLines;
+			offset += n->leftLen;
+			n = n->right;
 		}
+	}
+	const char* p = n->data;
+	while (--line > 0) // Skip to the last newline of the leaf that is needed
+		p = memchr(p, '\n', n->data + n->leftLen - p) + 1;
+	p = memchr(p, '\n', n->data + n->leftLen - p);
+	return offset + (p - n->data) + 1;
+}
+
+// Returns the line of the character at offset, both starting from zero, that is the number of newlines before it
+// The offset may be the length of the rope
+// Returns -1 if the offset is out of the rope
+ropeSize offsetToLine (struct node* rope, ropeSize offset) {
+	if (rope == NULL || offset < 0 || offset > rope->leftLen) {
+		currentError = PARAM;
+		return -1;
+	}
+	struct node* n = rope->left;
+	if (n == NULL)
+		return 0;
+	ropeSize line = 0;
+	while (n->left != NULL || n->right != NULL) {
+		if (offset < n->leftLen)
+			n = n->left;
 		else {
-			struct location * loc = malloc (sizeof(struct location));
-			loc->myNode = pFrom; // Throws if allocation fails
-			loc->myIndex = k;
-			return loc;
+			offset -= n->leftLen;
+			line += n->leftLines;
+			n = n->right;
 		}
 	}
-	if (k < pFrom->leftLen)
-		return gotoNode(pFrom->left, k);
-	else
-		return gotoNode(pFrom->right, k - pFrom->leftLen);
+	return line + countLines(n->data, offset);
+}
+
+// Returns the index of the byte that starts a UTF-8 code point, both starting from zero
+// The index of a code point is never inside a multibyte sequence, so it is a safe position for split
+// The code point may be the number of code points in the rope, and then the length of the rope is returned
+// Returns -1 if the rope has fewer code points
+ropeSize codePointToByte (struct node* rope, ropeSize codePoint) {
+	if (rope == NULL || codePoint < 0 || codePoint > rope->leftChars) {
+		currentError = PARAM;
+		return -1;
+	}
+	if (codePoint == rope->leftChars)
+		return rope->leftLen;
+	struct node* n = rope->left;
+	ropeSize offset = 0;
+	while (n->left != NULL || n->right != NULL) {
+		if (codePoint < n->leftChars)
+			n = n->left;
+		else {
+			codePoint -= n->leftChars;
+			offset += n->leftLen;
+			n = n->right;
+		}
+	}
+	int k = 0;
+	for (;; k++) // The leaf has the code point, so the loop ends inside the leaf
+		if ((n->data[k] & 0xC0) != 0x80 && codePoint-- == 0)
+			break;
+	return offset + k;
 }
 
-// Returns a new node that has left as left subtree and right as right subtree
-// The length of the left subtree is pLeftLen
-// Precondition: if left and/or right exist, they must have NULL parents
-struct node* concat (struct node* left, struct node* right, const int pLeftLen) {
-	if (left != NULL && left->parent != NULL || right != NULL && right->parent != NULL) {
+// Returns the number of UTF-8 code points that start before the byte at offset, both starting from zero
+// The offset may be the length of the rope
+// Returns -1 if the offset is out of the rope
+ropeSize byteToCodePoint (struct node* rope, ropeSize offset) {
+	if (rope == NULL || offset < 0 || offset > rope->leftLen) {
 		currentError = PARAM;
+		return -1;
+	}
+	struct node* n = rope->left;
+	if (n == NULL)
+		return 0;
+	ropeSize codePoints = 0;
+	while (n->left != NULL || n->right != NULL) {
+		if (offset < n->leftLen)
+			n = n->left;
+		else {
+			offset -= n->leftLen;
+			codePoints += n->leftChars;
+			n = n->right;
+		}
+	}
+	return codePoints + countCodePoints(n->data, offset);
+}
+
+// Returns a balanced subtree that has the characters of left followed by those of right
+// The length of the left subtree is pLeftLen, and the numbers of newlines and code points in it pLeftLines and pLeftChars
+// The subtrees are joined with rotations, so left and right are not necessarily the children of the returned node
+// The references of the caller to left and right are taken over by the returned subtree
+// Precondition: if left and/or right exist, they must be balanced and not be parts of any rope
+struct node* concat (struct node* left, struct node* right, const ropeSize pLeftLen, const ropeSize pLeftLines, const ropeSize pLeftChars) {
+	ROPE_COUNT(concats, 1);
+	struct node* n = initNodeIn(arenaOf(left != NULL ? left : right), 0);
+	if (n == NULL) {
+		currentError = ALLOC;
 		return NULL;
 	}
-	struct node* n = initNode(0);
-	if (n != NULL) {
-		n->left = left;
-		n->right = right;
-		n->leftLen = pLeftLen;
-		if (left != NULL)
-			left->parent = n;
-		if (right != NULL)
-			right->parent = n;
+	return joinWith(left, right, pLeftLen, pLeftLines, pLeftChars, n);
+}
+
+// Inserts dataLength bytes into the leaf of index i in place, when the leaf stays within LEAF_MAX_SIZE characters
+// An index between two leaves goes to the end of the left one, so typing at the end of a leaf grows the leaf
+// The nodes on the path are taken with own, so snapshots are not changed
+// Returns 1 if the bytes were inserted, or 0 if the general path is needed and nothing was changed
+short insertInLeaf (struct node* rope, const ropeSize i, const char* insertData, const int dataLength) {
+	if (isEmpty(rope) != 0 || dataLength > LEAF_MAX_SIZE)
+		return 0;
+	struct node* n = rope->left;
+	ropeSize pos = i - 1;
+	while (n->left != NULL || n->right != NULL) { // Find the leaf without changing anything
+		if (pos <= n->leftLen || n->right == NULL)
+			n = n->left;
+		else {
+			pos -= n->leftLen;
+			n = n->right;
+		}
 	}
-	else currentError = ALLOC;
+	if (n->leftLen + dataLength > LEAF_MAX_SIZE)
+		return 0;
+	int lines = countLines(insertData, dataLength), chars = countCodePoints(insertData, dataLength);
+	struct node** link = &rope->left;
+	pos = i - 1;
+	for (;;) { // Take the path and count the bytes on the way down
+		n = own(*link);
+		*link = n;
+		if (n->left == NULL && n->right == NULL)
+			break;
+		if (pos <= n->leftLen || n->right == NULL) {
+			n->leftLen += dataLength;
+			n->leftLines += lines;
+			n->leftChars += chars;
+			link = &n->left;
+		}
+		else {
+			pos -= n->leftLen;
+			link = &n->right;
+		}
+	}
+	if (growLeaf(n, n->leftLen + dataLength) == 0)
+		errorOccurred();
+	memmove(n->data + pos + dataLength, n->data + pos, n->leftLen - pos);
+	memcpy(n->data + pos, insertData, dataLength);
+	n->leftLen += dataLength;
+	n->leftLines += lines;
+	n->leftChars += chars;
+	rope->leftLen += dataLength;
+	rope->leftLines += lines;
+	rope->leftChars += chars;
+	return 1;
+}
+
+// Deletes the characters from index i to j in place, when they are inside one leaf that keeps some of its characters
+// Returns the number of characters left in the leaf, or 0 if the general path is needed and nothing was changed
+// *leafStart is set to the number of characters before the leaf
+int deleteInLeaf (struct node* rope, const ropeSize i, const ropeSize j, ropeSize* leafStart) {
+	ropeSize count = j - i + 1;
+	struct node* n = rope->left;
+	ropeSize pos = i - 1;
+	while (n->left != NULL || n->right != NULL) {
+		if (pos < n->leftLen || n->right == NULL)
+			n = n->left;
+		else {
+			pos -= n->leftLen;
+			n = n->right;
+		}
+	}
+	if (pos + count > n->leftLen || count == n->leftLen)
+		return 0;
+	short moves = pos + count < n->leftLen && (pos > 0 || (n->flags & NODE_SHARED_TEXT) == 0);
+	if (moves && n->leftLen > LEAF_MAX_SIZE) // Splitting a long leaf shares its text, moving would copy it
+		return 0;
+	int lines = countLines(n->data + pos, count), chars = countCodePoints(n->data + pos, count);
+	struct node** link = &rope->left;
+	*leafStart = i - 1 - pos;
+	pos = i - 1;
+	for (;;) {
+		n = own(*link);
+		*link = n;
+		if (n->left == NULL && n->right == NULL)
+			break;
+		if (pos < n->leftLen || n->right == NULL) {
+			n->leftLen -= count;
+			n->leftLines -= lines;
+			n->leftChars -= chars;
+			link = &n->left;
+		}
+		else {
+			pos -= n->leftLen;
+			link = &n->right;
+		}
+	}
+	if ((n->flags & NODE_SHARED_TEXT) != 0 && pos == 0)
+		n->data += count; // The text is read-only, the leaf is a view of it
+	else if (moves) {
+		if (growLeaf(n, n->leftLen) == 0)
+			errorOccurred();
+		memmove(n->data + pos, n->data + pos + count, n->leftLen - pos - count);
+	}
+	n->leftLen -= count;
+	n->leftLines -= lines;
+	n->leftChars -= chars;
+	rope->leftLen -= count;
+	rope->leftLines -= lines;
+	rope->leftChars -= chars;
+	return n->leftLen;
+}
+
+// Returns the leaf of the character at position pos, starting from zero, and sets *leafStart
+// to the number of characters before the leaf
+struct node* leafAt (struct node* rope, ropeSize pos, ropeSize* leafStart) {
+	struct node* n = rope->left;
+	*leafStart = pos;
+	while (n->left != NULL || n->right != NULL) {
+		if (pos < n->leftLen || n->right == NULL)
+			n = n->left;
+		else {
+			pos -= n->leftLen;
+			n = n->right;
+		}
+	}
+	*leafStart -= pos;
 	return n;
 }
 
-// Inserts a string into the rope
+// Finds the neighbour of the leaf of length characters after the first start characters, for merging them
+// The neighbour is the next leaf, or the previous one if the leaf is the last one
+// If the two leaves have at most LEAF_MAX_SIZE characters, copies them into merged, sets *first to the index
+// of the first of them, starting from one, and returns their length, otherwise returns 0
+int mergeableLeaves (struct node* rope, const ropeSize start, const int length, char* merged, ropeSize* first) {
+	ropeSize leftStart = start, rightStart = start + length;
+	if (rightStart == rope->leftLen) { // The last leaf
+		if (start == 0)
+			return 0; // The only leaf
+		leafAt(rope, start - 1, &leftStart);
+		rightStart = start;
+	}
+	struct node* left = leafAt(rope, leftStart, &leftStart);
+	struct node* right = leafAt(rope, rightStart, &rightStart);
+	int total = left->leftLen + right->leftLen;
+	if (total > LEAF_MAX_SIZE)
+		return 0;
+	memcpy(merged, left->data, left->leftLen);
+	memcpy(merged + left->leftLen, right->data, right->leftLen);
+	*first = leftStart + 1;
+	return total;
+}
+
+// Inserts dataLength bytes into the rope, the bytes may contain NULL characters
+// Small inserts change the target leaf in place, see insertInLeaf
 // Precondition: original rope must not be NULL (but may be empty)
-// 1..i-1, insertString, i..m like in wikipedia but more logical index for inserting
-struct node* insert (struct node* rope, int i, char* insertString) {
-	if (i < 1 || i > rope->leftLen + 1 || strlen(insertString) <= 0) {
+// 1..i-1, insertData, i..m like in wikipedia but more logical index for inserting
+struct node* insertBytes (struct node* rope, ropeSize i, const char* insertData, const int dataLength) {
+	if (rope == NULL || i < 1 || i > rope->leftLen + 1 || insertData == NULL || dataLength <= 0) {
 		// Rope is NULL, erroneous index, or nothing to insert
 		currentError = PARAM;
 		return rope;
 	}
+	ropeChanged(rope);
+	if (insertInLeaf(rope, i, insertData, dataLength) != 0)
+		return rope;
 	
 	struct node* newNode = NULL, * rightrope = NULL, * retval = NULL;
-	int dataLength = strlen(insertString);
-	int origLength = rope->leftLen;
-	newNode = initNode(dataLength);
+	ropeSize origLength = rope->leftLen, origLines = rope->leftLines, origChars = rope->leftChars;
+	struct ropeArena* arena = arenaOf(rope);
+	newNode = initNodeIn(arena, dataLength);
 	if (currentError != OK)
 		goto errorInInsert;
-	strcpy(newNode->data, insertString);
+	memcpy(newNode->data, insertData, dataLength);
+	countLeaf(newNode);
+	if (isLongLeaf(newNode) && shareOwnText(newNode) == 0) // Before snapshots can see the leaf
+		goto errorInInsert;
+	int dataLines = newNode->leftLines, dataChars = newNode->leftChars;
 	
 	if (isEmpty (rope) == 0) { // No need to concat if the original rope is empty	
-		if (i==1 || i==rope->leftLen + 1) { // No need to split
-			rope->left->parent = NULL; // Root will be removed
+		if (i==1 || i==rope->leftLen + 1) { // No need to split, root will be removed
 			if (i == 1)
-				newNode = concat(newNode, rope->left, dataLength);
+				newNode = concat(newNode, rope->left, dataLength, dataLines, dataChars);
 			else
-				newNode = concat(rope->left, newNode, origLength);
+				newNode = concat(rope->left, newNode, origLength, origLines, origChars);
 			if (currentError != OK) 
 				goto errorInInsert;
 		}
@@ -371,27 +1656,29 @@ struct node* insert (struct node* rope, int i, char* insertString) {
 				goto errorInInsert;
 			
 			// What is left from the rope after split, left side
-			rope->left->parent = NULL; // The unnecessary root of rope will be removed
-			newNode = concat(rope->left, newNode, rope->leftLen);
+			// The unnecessary root of rope will be removed
+			newNode = concat(rope->left, newNode, rope->leftLen, rope->leftLines, rope->leftChars);
 			if (currentError != OK) 
 				goto errorInInsert;
 
-			rightrope->left->parent = NULL; // Root will be removed
-			newNode = concat(newNode, rightrope->left, i-1 + dataLength);
+			newNode = concat(newNode, rightrope->left, i-1 + dataLength, rope->leftLines + dataLines, rope->leftChars + dataChars); // Root will be removed
 			if (currentError != OK)
 				goto errorInInsert;
 			freeNode(rightrope);
 		}
 	}
 	
-	if (rope != NULL)
-		freeNode(rope);
-	retval = initNode(0);
+	retval = initNodeIn(arena, 0);
 	if (currentError != OK)
 		goto errorInInsert;
+	handOverArena(rope, retval);
+	retval->version = rope->version;
+	freeNode(rope);
 	retval->leftLen = dataLength + origLength;
+	retval->leftLines = dataLines + origLines;
+	retval->leftChars = dataChars + origChars;
 	retval->left = newNode;
-	newNode->parent = retval;
+	updateHeight(retval);
 	return retval;
 	
 	errorInInsert:
@@ -406,18 +1693,45 @@ struct node* insert (struct node* rope, int i, char* insertString) {
 	errorOccurred();
 }
 
+// Inserts a string into the rope, without its terminal NULL character
+// The string becomes one leaf, so it may have at most INT32_MAX characters, longer texts are made with ropeFromBuffer
+// 1..i-1, insertString, i..m like in wikipedia but more logical index for inserting
+struct node* insert (struct node* rope, ropeSize i, char* insertString) {
+	if (insertString == NULL || strlen(insertString) > INT32_MAX) {
+		currentError = PARAM;
+		return rope;
+	}
+	return insertBytes(rope, i, insertString, strlen(insertString));
+}
+
 // Deletes a string from the rope
 // 1..i-1, j+1..m saved, other characters deleted, like in wikipedia
-struct node* delete (struct node* rope, int i, int j) {
+// Small deletes inside a leaf change the leaf in place, and a leaf that gets too small is merged with a neighbour
+struct node* delete (struct node* rope, ropeSize i, ropeSize j) {
 	if (isEmpty(rope) != 0) {
 		currentError = PARAM;
 		return rope;
 	}
-	size_t origLength = rope->leftLen;
+	ropeSize origLength = rope->leftLen;
 	if (i < 1 || j > origLength || j < i) {// Error
 		currentError = PARAM;
 		return rope;
 	}
+	ropeChanged(rope);
+	unsigned int version = rope->version; // For the root that replaces the rope
+	ropeSize leafStart = 0;
+	int leafLeft = deleteInLeaf(rope, i, j, &leafStart);
+	char merged[LEAF_MAX_SIZE];
+	int mergedLength = 0;
+	if (leafLeft > 0) {
+		if (leafLeft >= LEAF_MIN_SIZE)
+			return rope;
+		mergedLength = mergeableLeaves(rope, leafStart, leafLeft, merged, &i);
+		if (mergedLength == 0)
+			return rope;
+		j = i + mergedLength - 1; // Delete both leaves whole, they are inserted back as one below
+		origLength = rope->leftLen;
+	}
 		
 	struct node* leftRope=NULL, * middleRope = NULL, * rightRope = NULL, * retVal = NULL;
 	
@@ -439,32 +1753,38 @@ struct node* delete (struct node* rope, int i, int j) {
 
 	if (i==1) {
 		if (j == origLength) {
-			retVal = initNode(0);
+			retVal = initNodeIn(arenaOf(rope), 0);
 			if (currentError != OK)
 				goto errorInDelete;
 		}
 		else
 			retVal = rightRope;
+		handOverArena(rope, retVal); // The original root is freed with the middle part
 	}
 	else if (j == origLength)
 		retVal = leftRope;
 	else { // Both leftRope and rightRope contain nodes
-		int totSize = leftRope->leftLen + rightRope->leftLen;
-		leftRope->left->parent = NULL; // Root will be removed
-		rightRope->left->parent = NULL; // Root will be removed
-		struct node* n = concat(leftRope->left, rightRope->left, leftRope->leftLen);
+		ropeSize totSize = leftRope->leftLen + rightRope->leftLen;
+		ropeSize totLines = leftRope->leftLines + rightRope->leftLines, totChars = leftRope->leftChars + rightRope->leftChars;
+		struct node* n = concat(leftRope->left, rightRope->left, leftRope->leftLen, leftRope->leftLines, leftRope->leftChars); // Roots will be removed
 		if (currentError != OK) // If nodes cannot be allocated here, the rope is corrupted
 			goto errorInDelete;
-		retVal = initNode(0); // This is here in order to keep the original rope intact if creation fails
+		retVal = initNodeIn(arenaOf(rope), 0); // This is here in order to keep the original rope intact if creation fails
 		if (currentError != OK)
 			goto errorInDelete;
-		n->parent = retVal;
 		retVal->leftLen = totSize;
+		retVal->leftLines = totLines;
+		retVal->leftChars = totChars;
 		retVal->left = n;
+		updateHeight(retVal);
+		handOverArena(leftRope, retVal);
 		freeNode(leftRope);
 		freeNode(rightRope);
 	}
+	retVal->version = version;
 	freeAll(middleRope);
+	if (mergedLength > 0)
+		retVal = insertBytes(retVal, i, merged, mergedLength);
 	return retVal;
 	
 	errorInDelete:
@@ -482,138 +1802,2379 @@ struct node* delete (struct node* rope, int i, int j) {
 	errorOccurred();
 }
 
-// Recursively picks the characters into a buffer for collect-method, using inorder travelsal
-int inOrderPick (struct node* location, int charsLeft, char* buffer) {
-	if (charsLeft <	0) {
+// Picks the characters into a buffer for collect-method, using inorder travelsal
+// The first skip characters of the subtree are skipped, and only the subtrees that overlap the picked characters are visited
+// The characters are written from the beginning of buffer, and the number of them is returned
+// The right subtrees that are still to be picked from wait on a stack of ROPE_MAX_DEPTH nodes,
+// which is moved to the heap only if the tree is deeper than that, so no depth overflows the call stack
+// Calls errorOccurred if a deeper stack cannot be allocated
+ropeSize inOrderPick (struct node* location, ropeSize skip, ropeSize charsLeft, char* buffer) {
+	if (charsLeft <	0 || skip < 0) {
 		currentError = PARAM;
 		return 0;
 	}
-	if (location == NULL || charsLeft == 0)
-		return 0;
-	int origCharsLeft = charsLeft;
-	charsLeft -= inOrderPick (location->left, charsLeft, buffer);
-	if (location->left == NULL && location->right == NULL) { // I am leaf
-		int charsPicked = myMin(charsLeft, strlen(location->data));
-		strncat(buffer, location->data, charsPicked);
-		charsLeft -= charsPicked;
+	struct node* local[ROPE_MAX_DEPTH];
+	struct node** waiting = local;
+	int depth = 0, capacity = ROPE_MAX_DEPTH;
+	ropeSize charsPicked = 0;
+	while (charsPicked < charsLeft) {
+		if (location == NULL) { // Continue from the next waiting subtree
+			if (depth == 0)
+				break;
+			location = waiting[--depth];
+			skip = 0;
+		}
+		else if (location->left == NULL && location->right == NULL) { // I am leaf
+			ropeSize picked = sizeMin(charsLeft - charsPicked, location->leftLen - skip);
+			if (picked > 0) {
+				memcpy(buffer + charsPicked, location->data + skip, picked);
+				ROPE_COUNT(collectBytes, picked);
+				charsPicked += picked;
+			}
+			location = NULL;
+		}
+		else if (skip < location->leftLen) {
+			if (location->right != NULL && charsLeft - charsPicked > location->leftLen - skip) {
+				if (depth == capacity) {
+					struct node** p = malloc(2 * capacity * sizeof(struct node*));
+					if (p == NULL) {
+						currentError = ALLOC;
+						errorOccurred();
+					}
+					memcpy(p, waiting, depth * sizeof(struct node*));
+					if (waiting != local)
+						free (waiting);
+					waiting = p;
+					capacity *= 2;
+				}
+				waiting[depth++] = location->right;
+			}
+			location = location->left;
+		}
+		else {
+			skip -= location->leftLen;
+			location = location->right;
+		}
 	}
-	charsLeft -= inOrderPick (location->right, charsLeft, buffer);
-	return origCharsLeft - charsLeft;
+	if (waiting != local)
+		free (waiting);
+	return charsPicked;
 }
 
 // Collects the characters from index i to j, both included, and returns a string consisting of those characters
+// The string has a terminal NULL character after the j-i+1 characters, which may contain NULL characters too
 // starts from one
-char* collect (struct node* collectRope, int i, int j) {
-	if (i < 1 || j > collectRope->leftLen || j < i) {
+char* collect (struct node* collectRope, ropeSize i, ropeSize j) {
+	if (collectRope == NULL || i < 1 || j > collectRope->leftLen || j < i) {
 		currentError = PARAM;
 		return NULL;
 	}
-	char* nn;
-	int charsLeft = j-i+1;
-	struct location* location = gotoNode(collectRope, i-1);
-	if (currentError != OK)
+	char* nn = malloc ((j - i + 2) * sizeof(char)); // Terminal NULL
+	if (nn == NULL) {
+		currentError = ALLOC;
 		goto errorInCollect;
-	int charsPicked = myMin(charsLeft, strlen(location->myNode->data) - location->myIndex);
-	nn = malloc ((j - i + 2) * sizeof(char)); // Terminal NULL
-	if (currentError != OK) 
+	}
+	nn[j - i + 1] = '\0';
+	if (inOrderPick (collectRope->left, i - 1, j - i + 1, nn) != j - i + 1) { // leftLen does not match the leaves
+		currentError = INTERNAL;
 		goto errorInCollect;
-	strncpy(nn, location->myNode->data + location->myIndex, charsPicked);
-	nn[charsPicked] = '\0'; // strncpy does not add NULL (strncat does)
-	 // The characters in the first node  
-	charsLeft -= charsPicked;
-	struct node* whereIAm = location->myNode;
-	while (whereIAm != collectRope && charsLeft > 0) { // Continue inorder from here
-		if (whereIAm->parent->left == (struct node*) whereIAm) {
-			charsLeft -= inOrderPick (whereIAm->parent->right, charsLeft, nn);
-			if (currentError != OK) {
-				currentError = INTERNAL;
-				goto errorInCollect;
-			}				
-		}
-		whereIAm = whereIAm->parent;
-	}
-	if (charsLeft > 0) printf("Could not collect all characters \n");
+	}
 	return nn;
 	
 	errorInCollect:
 	printf (" %s ","Error in collect \n");
-	if (location != NULL)
-		free (location);
 	if (nn != NULL)
 		free (nn);
 	errorOccurred();
 }
 
-// Rebuilds recursively the nodes for rebuild-method
-struct node* rebuildNodes (struct node* rope, const int nodeSize, const int levels, int currentLevel, int* lengthLeft) {
-	struct node* retval = NULL;
-	if (currentLevel < levels) { // Non-leaf
-		int origLengthLeft = *lengthLeft;
-		retval = initNode(0);
-		if (currentError != OK)
+// Cursor for reading a rope sequentially, in both directions, without collecting it
+// The cursor is at a position from zero to the length of the rope, the length meaning the end of the rope
+// The cursor keeps the path from the root to its leaf, so moving through the whole rope is linear
+// and one step is amortized constant time
+// Any change to the rope invalidates its cursors, but not the cursors of its snapshots
+struct ropeCursor {
+	struct node* rope;
+	struct node* leaf; // Leaf of the character at the cursor, the last leaf at the end, NULL if the rope is empty
+	int index; // Index of the character in the leaf
+	ropeSize position; // Index of the character in the rope, starts from zero
+	int depth; // Depth of the leaf, path[depth] is the leaf
+	struct node* path[ROPE_MAX_DEPTH]; // path[0] is the root
+	unsigned char wentRight[ROPE_MAX_DEPTH]; // Whether path[d] is the right child of path[d-1]
+};
+
+// Descends from path[depth] to its leftmost or rightmost leaf, extending the path of the cursor
+void cursorDescend (struct ropeCursor* const cursor, const short rightmost) {
+	struct node* n = cursor->path[cursor->depth];
+	while (n->left != NULL || n->right != NULL) {
+		short right = (rightmost && n->right != NULL) || n->left == NULL;
+		n = right ? n->right : n->left;
+		cursor->depth++;
+		cursor->path[cursor->depth] = n;
+		cursor->wentRight[cursor->depth] = right;
+	}
+	cursor->leaf = n;
+}
+
+// Moves the path of the cursor to the next leaf, or to the previous one if backwards is set
+// Ascends while coming from the wrong side and then descends on the other side
+// Returns 0 if there is no such leaf, and then the cursor is unchanged
+short cursorStepLeaf (struct ropeCursor* const cursor, const short backwards) {
+	int d = cursor->depth;
+	while (d > 0 && (cursor->wentRight[d] == !backwards ||
+	  (backwards ? cursor->path[d - 1]->left : cursor->path[d - 1]->right) == NULL))
+		d--;
+	if (d == 0)
+		return 0;
+	struct node* parent = cursor->path[d - 1];
+	cursor->path[d] = backwards ? parent->left : parent->right;
+	cursor->wentRight[d] = !backwards;
+	cursor->depth = d;
+	cursorDescend(cursor, backwards);
+	return 1;
+}
+
+// Moves the cursor to a position of the rope, descending like gotoNode
+// Returns 1 on success and 0 if the position is out of the rope
+short cursorSeek (struct ropeCursor* const cursor, struct node* rope, ropeSize position) {
+	if (cursor == NULL || rope == NULL || position < 0 || position > rope->leftLen) {
+		currentError = PARAM;
+		return 0;
+	}
+	cursor->rope = rope;
+	cursor->position = position;
+	cursor->leaf = NULL;
+	cursor->index = 0;
+	cursor->depth = 0;
+	cursor->path[0] = rope;
+	if (isEmpty(rope) != 0)
+		return 1;
+	if (position == rope->leftLen) { // At the end
+		cursorDescend(cursor, 1);
+		cursor->index = cursor->leaf->leftLen;
+		return 1;
+	}
+	struct node* n = rope;
+	while (n->left != NULL || n->right != NULL) {
+		short right = position >= n->leftLen && n->right != NULL;
+		if (right)
+			position -= n->leftLen;
+		n = right ? n->right : n->left;
+		if (++cursor->depth == ROPE_MAX_DEPTH) {
+			currentError = INTERNAL;
+			return 0;
+		}
+		cursor->path[cursor->depth] = n;
+		cursor->wentRight[cursor->depth] = right;
+	}
+	cursor->leaf = n;
+	cursor->index = position;
+	return 1;
+}
+// Returns the character at the cursor as an unsigned char, or -1 at the end of the rope
+int cursorChar (const struct ropeCursor* const cursor) {
+	if (cursor->leaf == NULL || cursor->index >= cursor->leaf->leftLen)
+		return -1;
+	return (unsigned char) cursor->leaf->data[cursor->index];
+}
+
+// Returns the number of characters from the cursor to the end of its leaf, and sets *span to point to them
+// The characters stay in the rope, nothing is copied
+int cursorSpan (const struct ropeCursor* const cursor, const char** span) {
+	if (cursor->leaf == NULL) {
+		*span = NULL;
+		return 0;
+	}
+	*span = cursor->leaf->data + cursor->index;
+	return cursor->leaf->leftLen - cursor->index;
+}
+
+// Returns the number of characters before the cursor in its leaf, or in the previous leaf if the cursor
+// is at the beginning of its leaf, and sets *span to point to the first of them
+// Used for reading the rope backwards span by span
+int cursorSpanBefore (const struct ropeCursor* const cursor, const char** span) {
+	*span = NULL;
+	if (cursor->leaf == NULL || cursor->position == 0)
+		return 0;
+	if (cursor->index == 0) {
+		struct ropeCursor previous = *cursor;
+		cursorStepLeaf(&previous, 1);
+		*span = previous.leaf->data;
+		return previous.leaf->leftLen;
+	}
+	*span = cursor->leaf->data;
+	return cursor->index;
+}
+
+// Moves the cursor forward at most count characters, and returns the number of characters moved
+ropeSize cursorAdvance (struct ropeCursor* const cursor, ropeSize count) {
+	ropeSize moved = 0;
+	while (count > 0 && cursor->leaf != NULL && cursor->position < cursor->rope->leftLen) {
+		if (cursor->index == cursor->leaf->leftLen) {
+			cursorStepLeaf(cursor, 0);
+			cursor->index = 0;
+		}
+		int step = sizeMin(count, cursor->leaf->leftLen - cursor->index);
+		cursor->index += step;
+		cursor->position += step;
+		moved += step;
+		count -= step;
+	}
+	if (cursor->leaf != NULL && cursor->index == cursor->leaf->leftLen && cursor->position < cursor->rope->leftLen) {
+		cursorStepLeaf(cursor, 0); // Keep the cursor in the leaf of its character
+		cursor->index = 0;
+	}
+	return moved;
+}
+
+// Moves the cursor backward at most count characters, and returns the number of characters moved
+ropeSize cursorRetreat (struct ropeCursor* const cursor, ropeSize count) {
+	ropeSize moved = 0;
+	while (count > 0 && cursor->position > 0) {
+		if (cursor->index == 0) {
+			cursorStepLeaf(cursor, 1);
+			cursor->index = cursor->leaf->leftLen;
+		}
+		int step = sizeMin(count, cursor->index);
+		cursor->index -= step;
+		cursor->position -= step;
+		moved += step;
+		count -= step;
+	}
+	return moved;
+}
+
+// Moves the cursor to the next character, returns 0 if the cursor is already at the end
+short cursorNext (struct ropeCursor* const cursor) {
+	return (short) cursorAdvance(cursor, 1);
+}
+
+// Moves the cursor to the previous character, returns 0 if the cursor is already at the beginning
+short cursorPrev (struct ropeCursor* const cursor) {
+	return (short) cursorRetreat(cursor, 1);
+}
+
+// Copies at most count characters from the cursor to buffer and moves the cursor after them
+// Returns the number of characters copied
+ropeSize cursorRead (struct ropeCursor* const cursor, char* buffer, ropeSize count) {
+	ropeSize copied = 0;
+	const char* span;
+	int available;
+	while (count > 0 && (available = cursorSpan(cursor, &span)) > 0) {
+		int charsPicked = sizeMin(count, available);
+		memcpy(buffer + copied, span, charsPicked);
+		cursorAdvance(cursor, charsPicked);
+		copied += charsPicked;
+		count -= charsPicked;
+	}
+	return copied;
+}
+
+// Finger: the path to the leaf that was touched last, for editors and logs that work near one position
+// Nodes have no parent links, because a shared node has a parent in each rope, so the finger keeps
+// the path like a cursor, with the end of the subtree of each node on it.  A lookup ascends the path
+// only until the subtree contains the position and descends from there, so nearby positions
+// take O(log distance) steps instead of a descent from the root.
+// The finger stays valid across split, concat and every other change: it remembers the version of its
+// rope from the time it took its path, and if the rope has been changed since, it starts again from the root.
+// Changes of other ropes, snapshots of this one included, do not touch the path of the finger.
+// A finger must not be used with another rope that happens to get the address of its freed rope,
+// set it again with fingerReset.
+// Edits made through the finger that stay in its leaf keep its path, and the finger follows them.
+struct ropeFinger {
+	struct ropeCursor cursor; // Path and position of the finger, rope is NULL if the finger is not set
+	ropeSize ends[ROPE_MAX_DEPTH]; // ends[d] is the index after the last character of the subtree of path[d]
+	unsigned int version; // Version of the rope when the path was taken
+	short edge; // 1 if the path was taken by an append, -1 by a prepend, see ropeExtend, 0 by fingerSeek
+};
+
+// Makes the finger start from the root on its next use
+void fingerReset (struct ropeFinger* const finger) {
+	finger->cursor.rope = NULL;
+}
+
+// Moves the finger to the character at position, starting from zero
+// Returns 1 on success and 0 if the character does not exist
+short fingerSeek (struct ropeFinger* const finger, struct node* rope, const ropeSize position) {
+	if (finger == NULL || rope == NULL || position < 0 || position >= rope->leftLen) {
+		currentError = PARAM;
+		return 0;
+	}
+	struct ropeCursor* const c = &finger->cursor;
+	int d = 0;
+	ropeSize start = 0; // Index of the first character of the subtree of path[d]
+	if (c->rope != rope || c->leaf == NULL || finger->version != rope->version || finger->edge != 0) { // Nodes on the path may be gone
+		c->rope = rope;
+		finger->edge = 0; // The ends of an edge path are not kept
+		c->path[0] = rope;
+		finger->ends[0] = rope->leftLen;
+		finger->version = rope->version;
+	}
+	else { // Up until the subtree contains the position
+		d = c->depth;
+		start = c->position - c->index;
+		while (d > 0 && (position < start || position >= finger->ends[d])) {
+			if (c->wentRight[d])
+				start -= c->path[d - 1]->leftLen;
+			d--;
+		}
+	}
+	ROPE_COUNT(descents, 1);
+	struct node* n = c->path[d];
+	ropeSize pos = position - start;
+	while (n->left != NULL || n->right != NULL) {
+		ROPE_COUNT(descentSteps, 1);
+		short right = pos >= n->leftLen && n->right != NULL;
+		ropeSize end = right ? finger->ends[d] : start + n->leftLen;
+		if (right) {
+			start += n->leftLen;
+			pos -= n->leftLen;
+		}
+		n = right ? n->right : n->left;
+		if (++d == ROPE_MAX_DEPTH) {
+			c->rope = NULL;
+			currentError = INTERNAL;
+			return 0;
+		}
+		c->path[d] = n;
+		c->wentRight[d] = right;
+		finger->ends[d] = end;
+	}
+	c->depth = d;
+	c->leaf = n;
+	c->index = pos;
+	c->position = position;
+	return 1;
+}
+
+// Returns the character at position k, starting from zero, like kthChar but from the finger
+char fingerKthChar (struct ropeFinger* const finger, struct node* rope, const ropeSize k) {
+	if (fingerSeek(finger, rope, k) == 0)
+		return '\0';
+	return finger->cursor.leaf->data[finger->cursor.index];
+}
+
+// Returns 1 if no node on the path of the finger is shared, so the leaf and the counts on the path
+// may be changed in place
+short fingerOwnsPath (const struct ropeFinger* const finger) {
+	for (int d = 1; d <= finger->cursor.depth; d++)
+		if (finger->cursor.path[d]->refs != 1)
+			return 0;
+	return 1;
+}
+
+// Adds count characters, with the given newlines and code points, to the counts on the path of the finger
+// count is negative for a delete
+// Other fingers of the rope start from the root after this, and this one follows the change
+// Precondition: the finger has just been moved with fingerSeek
+void fingerCount (struct ropeFinger* const finger, const int count, const int lines, const int chars) {
+	struct ropeCursor* const c = &finger->cursor;
+	ropeChanged(c->rope);
+	finger->version = c->rope->version;
+	for (int d = c->depth; d > 0; d--) {
+		if (!c->wentRight[d]) { // The leaf is in the left subtree of the parent
+			c->path[d - 1]->leftLen += count;
+			c->path[d - 1]->leftLines += lines;
+			c->path[d - 1]->leftChars += chars;
+		}
+		finger->ends[d] += count;
+	}
+	finger->ends[0] += count;
+	c->leaf->leftLen += count;
+	c->leaf->leftLines += lines;
+	c->leaf->leftChars += chars;
+}
+
+// Inserts dataLength bytes into the rope like insertBytes, at the leaf of the finger if the index is near it
+// An insert that fits in the leaf changes it in place through the path of the finger, and the finger
+// moves to the last inserted character.  Other inserts are made by insertBytes
+struct node* fingerInsert (struct ropeFinger* const finger, struct node* rope, const ropeSize i, const char* insertData, const int dataLength) {
+	if (finger == NULL || rope == NULL || i < 1 || i > rope->leftLen + 1 || insertData == NULL || dataLength <= 0) {
+		currentError = PARAM;
+		return rope;
+	}
+	struct ropeCursor* const c = &finger->cursor;
+	// The finger goes to the character before the index, so that an index between two leaves goes
+	// to the end of the left one, like in insertInLeaf
+	if (isEmpty(rope) == 0 && dataLength <= LEAF_MAX_SIZE && fingerSeek(finger, rope, (i > 1) ? i - 2 : 0) != 0
+	  && c->leaf->leftLen + dataLength <= LEAF_MAX_SIZE && fingerOwnsPath(finger) != 0) {
+		struct node* leaf = c->leaf;
+		int pos = (i > 1) ? c->index + 1 : 0;
+		if (growLeaf(leaf, leaf->leftLen + dataLength) == 0)
 			errorOccurred();
-	// retVal->left = rebuildNodes with left info, retVal->right = rebuildNodes with length info, retVal->leftLen = length of left
-		retval->left = rebuildNodes(rope, nodeSize, levels, currentLevel + 1, lengthLeft);
-		if (retval->left != NULL)
-			retval->left->parent = retval;
-		retval->leftLen = origLengthLeft - (int) *lengthLeft;
-		retval->right = rebuildNodes(rope, nodeSize, levels, currentLevel + 1, lengthLeft);
-		if (retval->right != NULL)
-			retval->right->parent = retval;
+		memmove(leaf->data + pos + dataLength, leaf->data + pos, leaf->leftLen - pos);
+		memcpy(leaf->data + pos, insertData, dataLength);
+		fingerCount(finger, dataLength, countLines(insertData, dataLength), countCodePoints(insertData, dataLength));
+		c->index = pos + dataLength - 1;
+		c->position = i - 2 + dataLength;
+		return rope;
 	}
-	else {
-		// Leaf: make data with nodeSize or chars left if last char node and null if no more chars
-		if ((int) *lengthLeft > 0) { // If no more characters left, return NULL
-			int thisRound = myMin(nodeSize, (int) *lengthLeft);
-			retval = initNode(thisRound);
-			if (currentError != OK)
+	fingerReset(finger);
+	return insertBytes(rope, i, insertData, dataLength);
+}
+
+// Deletes the characters from index i to j like delete, in the leaf of the finger if they are near it
+// A delete inside the leaf that keeps at least LEAF_MIN_SIZE characters in it changes the leaf in place
+// through the path of the finger.  Other deletes are made by delete
+struct node* fingerDelete (struct ropeFinger* const finger, struct node* rope, const ropeSize i, const ropeSize j) {
+	if (finger == NULL || isEmpty(rope) != 0 || i < 1 || j > rope->leftLen || j < i) {
+		currentError = PARAM;
+		return rope;
+	}
+	struct ropeCursor* const c = &finger->cursor;
+	ropeSize count = j - i + 1;
+	if (fingerSeek(finger, rope, i - 1) != 0 && c->index + count <= c->leaf->leftLen
+	  && c->leaf->leftLen - count >= LEAF_MIN_SIZE && (c->leaf->flags & NODE_SHARED_TEXT) == 0
+	  && fingerOwnsPath(finger) != 0) {
+		struct node* leaf = c->leaf;
+		int pos = c->index;
+		int lines = countLines(leaf->data + pos, count), chars = countCodePoints(leaf->data + pos, count);
+		memmove(leaf->data + pos, leaf->data + pos + count, leaf->leftLen - pos - count);
+		fingerCount(finger, -count, -lines, -chars);
+		if (c->index == leaf->leftLen) { // The tail of the leaf was deleted, the finger stays in the leaf
+			c->index--;
+			c->position--;
+		}
+		return rope;
+	}
+	fingerReset(finger);
+	return delete(rope, i, j);
+}
+
+// Returns the link from path[d - 1] to path[d] on the first or last edge of the rope of the cursor,
+// the root has only a left link
+struct node** edgeLink (struct ropeCursor* const c, const int d, const short front) {
+	struct node* parent = c->path[d - 1];
+	return (front || d == 1) ? &parent->left : &parent->right;
+}
+
+// Extends the path of the cursor from path[depth] down the first or last edge to the edge leaf
+// Internal nodes on the way are taken with own, so that the counts and links on the edge may be changed
+// in place without changing snapshots.  The leaf is not taken, it is only copied if it gets characters
+// Returns 0 if the rope is too deep
+short edgeDescend (struct ropeCursor* const c, const short front) {
+	struct node* n = c->path[c->depth];
+	while (n->left != NULL || n->right != NULL) {
+		if (c->depth + 1 == ROPE_MAX_DEPTH) {
+			currentError = INTERNAL;
+			return 0;
+		}
+		c->depth++;
+		struct node** link = edgeLink(c, c->depth, front);
+		if ((*link)->left != NULL || (*link)->right != NULL)
+			*link = own(*link);
+		n = *link;
+		c->path[c->depth] = n;
+	}
+	c->leaf = (c->depth > 0) ? n : NULL;
+	return 1;
+}
+
+// Appends dataLength bytes to the end of the rope, or prepends them to its beginning if front is set
+// The bytes first fill the free room of the edge leaf, up to LEAF_MAX_SIZE characters and without cutting
+// a UTF-8 sequence of the data, and the rest becomes one new leaf next to the edge leaf, with room to grow to LEAF_MAX_SIZE.  So a rope that grows
+// a line at a time gets full leaves and the tree changes once per leaf and not once per line.
+// If finger is not NULL, the path to the edge leaf is kept in it, and while the version of the rope
+// stays the same, the next append starts from that leaf instead of walking the edge from the root.
+// When appending, the nodes above the leaf keep their counts, and a new leaf is rebalanced upwards only
+// as long as the heights change, so appends through a finger are amortized O(1).  A prepend adds to
+// leftLen of every node on the edge, so it stays O(log n), and so do appends without a finger.
+// The nodes on the edge are taken with own when the path is taken, so snapshots are not changed.
+// A snapshot counts as a change of its rope, so a kept edge never has shared nodes.
+// The finger is left on the last character, or the first one if front is set
+struct node* ropeExtend (struct ropeFinger* const finger, struct node* rope, const char* data, const int dataLength, const short front) {
+	if (rope == NULL || data == NULL || dataLength <= 0) {
+		currentError = PARAM;
+		return rope;
+	}
+	struct ropeCursor local;
+	struct ropeCursor* const c = (finger != NULL) ? &finger->cursor : &local;
+	const short edge = front ? -1 : 1;
+	if (finger == NULL || c->rope != rope || finger->version != rope->version || finger->edge != edge) {
+		c->rope = rope;
+		c->depth = 0;
+		c->path[0] = rope;
+		if (edgeDescend(c, front) == 0)
+			errorOccurred();
+	}
+	ropeChanged(rope);
+	int depth = c->depth;
+	struct node** const path = c->path;
+	int lines = countLines(data, dataLength), chars = countCodePoints(data, dataLength);
+	int fit = 0; // Characters that go into the edge leaf
+	if (depth > 0 && path[depth]->leftLen < LEAF_MAX_SIZE)
+		fit = myMin(dataLength, LEAF_MAX_SIZE - path[depth]->leftLen);
+	// A cut inside the data does not cut a UTF-8 sequence in two: the leaf then gets the sequence whole or not at all
+	for (int k = 0; k < 3 && fit > 0 && fit < dataLength && (data[front ? dataLength - fit : fit] & 0xC0) == 0x80; k++)
+		fit--;
+	if (fit > 0) {
+		struct node* n = own(path[depth]); // Usually nothing to copy
+		*edgeLink(c, depth, front) = n;
+		path[depth] = n;
+		if (growLeaf(n, n->leftLen + fit) == 0)
+			errorOccurred();
+		const char* part = front ? data + dataLength - fit : data; // The end of the data goes before the first leaf
+		int partLines = (fit == dataLength) ? lines : countLines(part, fit);
+		int partChars = (fit == dataLength) ? chars : countCodePoints(part, fit);
+		if (front) {
+			memmove(n->data + fit, n->data, n->leftLen);
+			memcpy(n->data, part, fit);
+			for (int d = 1; d < depth; d++) { // The leaf is in the left subtree of every node on the edge
+				path[d]->leftLen += fit;
+				path[d]->leftLines += partLines;
+				path[d]->leftChars += partChars;
+			}
+		}
+		else
+			memcpy(n->data + n->leftLen, part, fit);
+		n->leftLen += fit;
+		n->leftLines += partLines;
+		n->leftChars += partChars;
+	}
+	int rest = dataLength - fit;
+	if (rest > 0) {
+		struct node* leaf = initNodeIn(arenaOf(rope), (rest < LEAF_MAX_SIZE) ? LEAF_MAX_SIZE : rest);
+		if (leaf == NULL)
+			errorOccurred();
+		memcpy(leaf->data, front ? data : data + fit, rest);
+		leaf->leftLen = rest;
+		countLeaf(leaf);
+		if (isLongLeaf(leaf) && shareOwnText(leaf) == 0)
+			errorOccurred();
+		struct node* sub = leaf; // Subtree that takes the place of path[d + 1]
+		int d = depth - 1;
+		if (depth > 0) {
+			struct node* n = initNodeIn(arenaOf(rope), 0);
+			if (n == NULL)
 				errorOccurred();
-			int begin = rope->leftLen - (int) *lengthLeft +1;
-			retval->data = strcpy(retval->data, collect(rope, begin, begin + thisRound - 1));
-			printf(" %s ",retval->data);
-			if (currentError != OK) {
-				free (retval);
-				errorOccurred ();
+			struct node* old = path[depth];
+			if (front)
+				sub = attach(n, leaf, old, rest, leaf->leftLines, leaf->leftChars);
+			else
+				sub = attach(n, old, leaf, old->leftLen, old->leftLines, old->leftChars);
+		}
+		for (; d > 0; d--) { // Up the edge, like an AVL insert
+			struct node* n = path[d];
+			int height = n->height;
+			*edgeLink(c, d + 1, front) = sub;
+			if (front) {
+				n->leftLen += rest;
+				n->leftLines += leaf->leftLines;
+				n->leftChars += leaf->leftChars;
 			}
-			*lengthLeft -= thisRound;
+			sub = rebalance(n);
+			if (sub == n && n->height == height) // The nodes above keep their heights
+				break;
+		}
+		if (d <= 0) {
+			rope->left = sub;
+			d = 0;
 		}
+		else if (front)
+			for (int e = d - 1; e > 0; e--) {
+				path[e]->leftLen += rest;
+				path[e]->leftLines += leaf->leftLines;
+				path[e]->leftChars += leaf->leftChars;
+			}
+		c->depth = d; // The edge is taken again below the highest node that changed
+		if (edgeDescend(c, front) == 0)
+			errorOccurred();
 	}
-	return retval;
+	rope->leftLen += dataLength;
+	rope->leftLines += lines;
+	rope->leftChars += chars;
+	updateHeight(rope);
+	if (finger != NULL) {
+		c->leaf = path[c->depth];
+		c->index = front ? 0 : c->leaf->leftLen - 1;
+		c->position = front ? 0 : rope->leftLen - 1;
+		finger->version = rope->version;
+		finger->edge = edge;
+	}
+	return rope;
 }
 
-// Makes a balanced copy of the whole rope, so that:
-// All data leafs have the same number of characters, except possibly the last one
-// All paths from root to leafs that contain data have the same length
-// Last level is filled from the left to right, the rightmost nodes may be missing
-// The original rope is not freed (if you want to free it, use the freeAll-method)
-// If there is no data in the rope, the original rope is returned and not copied
-// Precondition: rope size must not be extremely small compared to nodeSize
-struct node* rebuild (struct node* rope, const int nodeSize) {
-	if (rope == NULL || rope->leftLen < 0 || nodeSize <= 0) {
+// Appends dataLength bytes to the end of the rope, see ropeExtend
+struct node* ropeAppend (struct node* rope, const char* data, const int dataLength) {
+	return ropeExtend(NULL, rope, data, dataLength, 0);
+}
+
+// Prepends dataLength bytes to the beginning of the rope, see ropeExtend
+struct node* ropePrepend (struct node* rope, const char* data, const int dataLength) {
+	return ropeExtend(NULL, rope, data, dataLength, 1);
+}
+
+// Appends dataLength bytes to the end of the rope through the finger, in amortized O(1), see ropeExtend
+struct node* fingerAppend (struct ropeFinger* const finger, struct node* rope, const char* data, const int dataLength) {
+	if (finger == NULL) {
 		currentError = PARAM;
-		errorOccurred();
+		return rope;
 	}
-	int leaves = 0;
-	int levels = 0;
-	if (rope->leftLen > 0) { // TODO: Check if ceil gives an exact integer (ceil returns double)
-		leaves = ceil ((double) rope->leftLen / nodeSize); // Cannot be zero 
-		//unless inappropriate parameters result in precision issues
-		levels = ceil (log2 (leaves));
+	return ropeExtend(finger, rope, data, dataLength, 0);
+}
+
+// Prepends dataLength bytes to the beginning of the rope through the finger, see ropeExtend
+struct node* fingerPrepend (struct ropeFinger* const finger, struct node* rope, const char* data, const int dataLength) {
+	if (finger == NULL) {
+		currentError = PARAM;
+		return rope;
 	}
-	else
-		return rope; // Empty rope
-	
-	struct node* retVal = initNode(0);
-	if (currentError != OK)
-		errorOccurred();
-	int leftLength = rope->leftLen;
-	int* lenPtr = &leftLength;
-	retVal->leftLen = leftLength;
-	retVal->left = rebuildNodes(rope, nodeSize, levels, 0, lenPtr);
-	retVal->left->parent = retVal;
-	return retVal;
+	return ropeExtend(finger, rope, data, dataLength, 1);
+}
+
+// View of characters inside a leaf, see collectSpans
+struct ropeSpan {
+	const char* data;
+	int length;
+};
+
+// Returns the characters from index i to j, both included, as an array of views into the leaves,
+// so that they can be written, hashed or compared without copying them
+// starts from one, like collect
+// *count is set to the number of spans
+// The spans are valid until the rope changes, and only the array is allocated: free it with free
+struct ropeSpan* collectSpans (struct node* collectRope, ropeSize i, ropeSize j, int* count) {
+	if (collectRope == NULL || count == NULL || i < 1 || j > collectRope->leftLen || j < i) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct ropeCursor cursor;
+	if (cursorSeek(&cursor, collectRope, i - 1) == 0)
+		return NULL;
+	int capacity = 8;
+	struct ropeSpan* spans = malloc(capacity * sizeof(struct ropeSpan));
+	if (spans == NULL) {
+		currentError = ALLOC;
+		return NULL;
+	}
+	*count = 0;
+	ropeSize charsLeft = j - i + 1;
+	while (charsLeft > 0) {
+		const char* span;
+		int available = cursorSpan(&cursor, &span);
+		if (available == 0) { // leftLen does not match the leaves
+			free (spans);
+			currentError = INTERNAL;
+			return NULL;
+		}
+		if (*count == capacity) {
+			struct ropeSpan* p = realloc(spans, 2 * capacity * sizeof(struct ropeSpan));
+			if (p == NULL) {
+				free (spans);
+				currentError = ALLOC;
+				return NULL;
+			}
+			spans = p;
+			capacity *= 2;
+		}
+		int charsPicked = sizeMin(charsLeft, available);
+		spans[*count].data = span;
+		spans[*count].length = charsPicked;
+		(*count)++;
+		cursorAdvance(&cursor, charsPicked);
+		charsLeft -= charsPicked;
+	}
+	return spans;
+}
+
+// Returns the index of the first candidate for a match from start on in length bytes of data, or length if there is none
+// A candidate has the first two bytes of the needle, or only the first one at the last byte of the data,
+// because the second one is then in the next leaf.  The bytes are compared 32 (AVX2) or 16 (SSE2) at a time
+int nextCandidate (const char* data, int start, const int length, const char first, const char second) {
+	int k = start;
+#if defined(__AVX2__)
+	const __m256i firsts = _mm256_set1_epi8(first), seconds = _mm256_set1_epi8(second);
+	for (; k + 33 <= length; k += 32) {
+		__m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + k)), firsts),
+		  _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + k + 1)), seconds));
+		unsigned mask = _mm256_movemask_epi8(hits);
+		if (mask != 0)
+			return k + __builtin_ctz(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i firsts = _mm_set1_epi8(first), seconds = _mm_set1_epi8(second);
+	for (; k + 17 <= length; k += 16) {
+		__m128i hits = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + k)), firsts),
+		  _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + k + 1)), seconds));
+		unsigned mask = _mm_movemask_epi8(hits);
+		if (mask != 0)
+			return k + __builtin_ctz(mask);
+	}
+#endif
+	for (; k < length; k++)
+		if (data[k] == first && (k + 1 == length || data[k + 1] == second))
+			return k;
+	return length;
+}
+
+// Returns whether the rope has the needle of length bytes at the cursor
+// The cursor is copied, so a match that continues in the next leaves is read without changing the cursor
+short matchAt (const struct ropeCursor* const cursor, const char* needle, int length) {
+	struct ropeCursor at = *cursor;
+	while (length > 0) {
+		const char* span;
+		int available = myMin(cursorSpan(&at, &span), length);
+		if (available == 0 || memcmp(span, needle, available) != 0)
+			return 0;
+		needle += available;
+		length -= available;
+		cursorAdvance(&at, available);
+	}
+	return 1;
+}
+
+// Returns the index of the first occurrence of the needle of length bytes at or after index from,
+// both starting from zero, or -1 if there is none
+// The rope is scanned leaf by leaf without collecting it, candidates are filtered with nextCandidate,
+// and a match that continues over a leaf boundary is read with a copy of the cursor
+ropeSize ropeFind (struct node* rope, const char* needle, const int length, const ropeSize from) {
+	if (rope == NULL || (needle == NULL && length > 0) || length < 0 || from < 0 || from > rope->leftLen) {
+		currentError = PARAM;
+		return -1;
+	}
+	if (length == 0)
+		return from;
+	struct ropeCursor cursor;
+	if (cursorSeek(&cursor, rope, from) == 0)
+		return -1;
+	char second = (length > 1) ? needle[1] : 0;
+	while (cursor.position + length <= rope->leftLen) {
+		const char* span;
+		int available = cursorSpan(&cursor, &span);
+		for (int k = 0; k < available; k++) {
+			if (length == 1) {
+				const char* hit = memchr(span + k, needle[0], available - k);
+				if (hit != NULL)
+					return cursor.position + (hit - span);
+				break;
+			}
+			k = nextCandidate(span, k, available, needle[0], second);
+			if (k == available || cursor.position + k + length > rope->leftLen)
+				break;
+			if (k + length <= available) {
+				if (memcmp(span + k, needle, length) == 0)
+					return cursor.position + k;
+			}
+			else {
+				struct ropeCursor at = cursor;
+				cursorAdvance(&at, k);
+				if (matchAt(&at, needle, length))
+					return cursor.position + k;
+			}
+		}
+		if (cursorAdvance(&cursor, available) == 0)
+			break;
+	}
+	return -1;
+}
+
+// Comparison and hashing
+// Ropes are compared leaf span by leaf span with memcmp, which is vectorized in the C library,
+// without collecting them.  A subtree that both ropes share at the same index, such as the untouched
+// part of a snapshot, is skipped without reading it.
+
+// Subtrees that are still to be read from a rope, in order: the last one is at the current index
+struct ropeWalk {
+	struct node* nodes[ROPE_MAX_DEPTH + 1];
+	ropeSize lengths[ROPE_MAX_DEPTH + 1];
+	int count;
+	int offset; // Characters already read from the last subtree, which is then a leaf
+};
+
+void walkStart (struct ropeWalk* const walk, const struct node* const rope) {
+	walk->count = 0;
+	walk->offset = 0;
+	if (isEmpty(rope) == 0) {
+		walk->nodes[0] = rope->left;
+		walk->lengths[0] = rope->leftLen;
+		walk->count = 1;
+	}
+}
+
+// Replaces the last subtree of the walk with its two subtrees
+void walkExpand (struct ropeWalk* const walk) {
+	int k = walk->count - 1;
+	struct node* n = walk->nodes[k];
+	if (n->right != NULL) {
+		walk->nodes[k] = n->right;
+		walk->lengths[k] -= n->leftLen;
+		k++;
+	}
+	walk->nodes[k] = n->left;
+	walk->lengths[k] = n->leftLen;
+	walk->count = k + 1;
+}
+
+// Moves the walk count characters forward in its last subtree, which must be a leaf
+void walkSkip (struct ropeWalk* const walk, const ropeSize count) {
+	walk->offset += count;
+	if (walk->offset == walk->lengths[walk->count - 1]) {
+		walk->count--;
+		walk->offset = 0;
+	}
+}
+
+// Compares two ropes like memcmp, as unsigned bytes, and a rope that is a prefix of the other one is less
+// Returns a negative number, zero or a positive number when a is less than, equal to or greater than b
+// The subtree that is longer is split first, so a subtree of both ropes at the same index is found
+// at the front of both walks and skipped
+int ropeCompare (const struct node* a, const struct node* b) {
+	struct ropeWalk wa, wb;
+	walkStart(&wa, a);
+	walkStart(&wb, b);
+	while (wa.count > 0 && wb.count > 0) {
+		int ka = wa.count - 1, kb = wb.count - 1;
+		struct node* na = wa.nodes[ka], * nb = wb.nodes[kb];
+		short leafA = na->left == NULL && na->right == NULL, leafB = nb->left == NULL && nb->right == NULL;
+		if (na == nb && wa.offset == 0 && wb.offset == 0) { // Shared subtree, the same characters
+			wa.count--;
+			wb.count--;
+		}
+		else if (!leafA && (leafB || wa.lengths[ka] >= wb.lengths[kb]))
+			walkExpand(&wa);
+		else if (!leafB)
+			walkExpand(&wb);
+		else if (wa.lengths[ka] == 0)
+			walkSkip(&wa, 0);
+		else if (wb.lengths[kb] == 0)
+			walkSkip(&wb, 0);
+		else {
+			ropeSize count = sizeMin(wa.lengths[ka] - wa.offset, wb.lengths[kb] - wb.offset);
+			int result = memcmp(na->data + wa.offset, nb->data + wb.offset, count);
+			if (result != 0)
+				return result;
+			walkSkip(&wa, count);
+			walkSkip(&wb, count);
+		}
+	}
+	return (wa.count > 0) - (wb.count > 0);
+}
+
+// Returns 1 if the ropes have the same characters, otherwise 0
+// Ropes with different lengths or counts of newlines or code points differ without reading them
+short ropeEqual (const struct node* a, const struct node* b) {
+	if (a->leftLen != b->leftLen || a->leftLines != b->leftLines || a->leftChars != b->leftChars)
+		return 0;
+	return ropeCompare(a, b) == 0;
+}
+
+// Streaming 64-bit hash of a sequence of spans, the XXH64 algorithm
+// The hash depends only on the characters, not on how they are split into spans,
+// so ropes with the same characters have the same hash whatever their leaves are
+#define HASH_PRIME1 11400714785074694791ULL
+#define HASH_PRIME2 14029467366897019727ULL
+#define HASH_PRIME3 1609587929392839161ULL
+#define HASH_PRIME4 9650029242287828579ULL
+#define HASH_PRIME5 2870177450012600261ULL
+
+struct hashState {
+	uint64_t lanes[4];
+	uint64_t seed;
+	uint64_t total; // Characters hashed so far
+	unsigned char buffer[32]; // Characters that do not yet fill a stripe of 32
+	int buffered;
+};
+
+uint64_t hashRotate (const uint64_t x, const int bits) {
+	return (x << bits) | (x >> (64 - bits));
+}
+
+uint64_t hashRound (uint64_t lane, const uint64_t input) {
+	lane += input * HASH_PRIME2;
+	return hashRotate(lane, 31) * HASH_PRIME1;
+}
+
+uint64_t hashRead64 (const unsigned char* p) {
+	uint64_t x;
+	memcpy(&x, p, 8); // Little-endian hosts, as the rest of the file
+	return x;
+}
+
+void hashStart (struct hashState* const h, const uint64_t seed) {
+	h->lanes[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+	h->lanes[1] = seed + HASH_PRIME2;
+	h->lanes[2] = seed;
+	h->lanes[3] = seed - HASH_PRIME1;
+	h->seed = seed;
+	h->total = 0;
+	h->buffered = 0;
+}
+
+// Hashes the stripes of 32 characters from p, and returns the number of characters hashed
+size_t hashStripes (struct hashState* const h, const unsigned char* p, const size_t length) {
+	size_t k = 0;
+	for (; k + 32 <= length; k += 32)
+		for (int lane = 0; lane < 4; lane++)
+			h->lanes[lane] = hashRound(h->lanes[lane], hashRead64(p + k + 8 * lane));
+	return k;
+}
+
+void hashUpdate (struct hashState* const h, const char* data, size_t length) {
+	const unsigned char* p = (const unsigned char*) data;
+	h->total += length;
+	if (h->buffered > 0) { // Fill the stripe that was left over from the previous span
+		size_t taken = (length < (size_t) (32 - h->buffered)) ? length : (size_t) (32 - h->buffered);
+		memcpy(h->buffer + h->buffered, p, taken);
+		h->buffered += taken;
+		p += taken;
+		length -= taken;
+		if (h->buffered < 32)
+			return;
+		hashStripes(h, h->buffer, 32);
+		h->buffered = 0;
+	}
+	size_t done = hashStripes(h, p, length);
+	memcpy(h->buffer, p + done, length - done);
+	h->buffered = length - done;
+}
+
+uint64_t hashDigest (const struct hashState* const h) {
+	uint64_t result;
+	if (h->total >= 32) {
+		result = hashRotate(h->lanes[0], 1) + hashRotate(h->lanes[1], 7) + hashRotate(h->lanes[2], 12) + hashRotate(h->lanes[3], 18);
+		for (int lane = 0; lane < 4; lane++) {
+			result ^= hashRound(0, h->lanes[lane]);
+			result = result * HASH_PRIME1 + HASH_PRIME4;
+		}
+	}
+	else
+		result = h->seed + HASH_PRIME5;
+	result += h->total;
+	const unsigned char* p = h->buffer;
+	int left = h->buffered;
+	for (; left >= 8; p += 8, left -= 8) {
+		result ^= hashRound(0, hashRead64(p));
+		result = hashRotate(result, 27) * HASH_PRIME1 + HASH_PRIME4;
+	}
+	if (left >= 4) {
+		uint32_t x;
+		memcpy(&x, p, 4);
+		result ^= x * HASH_PRIME1;
+		result = hashRotate(result, 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; p++, left--) {
+		result ^= *p * HASH_PRIME5;
+		result = hashRotate(result, 11) * HASH_PRIME1;
+	}
+	result ^= result >> 33;
+	result *= HASH_PRIME2;
+	result ^= result >> 29;
+	result *= HASH_PRIME3;
+	result ^= result >> 32;
+	return result;
+}
+
+// Returns the XXH64 hash of the characters of the rope with the given seed, read leaf span by leaf span
+uint64_t ropeHash (struct node* rope, const uint64_t seed) {
+	struct hashState h;
+	hashStart(&h, seed);
+	struct ropeCursor cursor;
+	if (cursorSeek(&cursor, rope, 0) != 0) {
+		const char* span;
+		int available;
+		while ((available = cursorSpan(&cursor, &span)) > 0) {
+			hashUpdate(&h, span, available);
+			cursorAdvance(&cursor, available);
+		}
+	}
+	return hashDigest(&h);
+}
+
+// Returns the index where leaf k of a rebuild starts: k * nodeSize, or the start of the UTF-8 sequence
+// that would be cut there, or the length of the rope if it is shorter
+// Leaves of fewer than four characters are cut anywhere, so that none of them becomes empty
+ropeSize rebuildLeafStart (struct node* rope, const ropeSize k, const int nodeSize) {
+	ropeSize start = k * nodeSize;
+	if (start >= rope->leftLen)
+		return rope->leftLen;
+	if (start == 0 || nodeSize <= 3)
+		return start;
+	char bytes[4]; // Before start, like the end of the leaf in rebuildNodes
+	struct ropeCursor cursor;
+	if (cursorSeek(&cursor, rope, start - 4) == 0 || cursorRead(&cursor, bytes, 4) != 4)
+		errorOccurred();
+	return start - 4 + codePointBoundary(bytes, 4);
+}
+
+// Rebuilds recursively the nodes for rebuild-method
+// The subtree gets the given number of leaves, the left subtree gets the extra leaf if the number is odd
+// Leaves are filled in order from the source cursor, so the whole source is read once
+// Leaf k ends where leaf k + 1 starts, see rebuildLeafStart, so no leaf ends inside a UTF-8 sequence
+// and a leaf has up to three characters more or less than nodeSize
+// The nodes are allocated from arena, or with malloc if arena is NULL
+struct node* rebuildNodes (struct ropeArena* arena, struct ropeCursor* source, const int nodeSize, const ropeSize leaves, ropeSize* lengthLeft) {
+	struct node* retval = NULL;
+	if (leaves > 1) { // Non-leaf
+		ropeSize origLengthLeft = *lengthLeft;
+		retval = initNodeIn(arena, 0);
+		if (retval == NULL)
+			errorOccurred();
+	// retVal->left = rebuildNodes with left info, retVal->right = rebuildNodes with length info, retVal->leftLen = length of left
+		retval->left = rebuildNodes(arena, source, nodeSize, leaves - leaves / 2, lengthLeft);
+		retval->leftLen = origLengthLeft - *lengthLeft;
+		retval->leftLines = subtreeLines(retval->left);
+		retval->leftChars = subtreeChars(retval->left);
+		retval->right = rebuildNodes(arena, source, nodeSize, leaves / 2, lengthLeft);
+		updateHeight(retval);
+	}
+	else {
+		// Leaf: make data up to the start of the next leaf or with the chars left if last char node
+		// The leaf starts less than four characters before k * nodeSize, so k is found from its start
+		ropeSize start = source->position;
+		ropeSize end = ((nodeSize > 3 ? start + 3 : start) / nodeSize + 1) * nodeSize;
+		int thisRound = sizeMin(end - start, *lengthLeft);
+		retval = initNodeIn(arena, thisRound);
+		if (retval == NULL)
+			errorOccurred();
+		cursorRead(source, retval->data, thisRound);
+		if (thisRound < *lengthLeft && nodeSize > 3) { // Not the last leaf, the next one takes a cut sequence
+			int cut = codePointBoundary(retval->data, thisRound);
+			cursorRetreat(source, thisRound - cut);
+			retval->leftLen = thisRound = cut;
+		}
+		countLeaf(retval);
+		*lengthLeft -= thisRound;
+	}
+	return retval;
+}
+
+// Makes a balanced copy of the whole rope, so that:
+// All data leafs have the same number of characters, except possibly the last one, up to three characters
+// more or less so that no leaf ends inside a UTF-8 sequence
+// The leaves are halved at every node, so the heights of two sibling subtrees differ at most by one
+// The original rope is read once leaf by leaf, so the copy takes linear time
+// The original rope is not freed (if you want to free it, use the freeAll-method)
+// If the original rope is in an arena, the copy gets a new arena of its own
+// If there is no data in the rope, the original rope is returned and not copied
+struct node* rebuild (struct node* rope, const int nodeSize) {
+	if (rope == NULL || rope->leftLen < 0 || nodeSize <= 0) {
+		currentError = PARAM;
+		errorOccurred();
+	}
+	if (rope->leftLen == 0)
+		return rope; // Empty rope
+	ropeSize leaves = (rope->leftLen + nodeSize - 1) / nodeSize;
+	
+	struct ropeArena* arena = NULL;
+	struct node* retVal = NULL;
+	if (arenaOf(rope) != NULL)
+		retVal = newArenaRope();
+	else
+		retVal = initNode(0);
+	if (retVal == NULL)
+		errorOccurred();
+	arena = arenaOf(retVal);
+	struct ropeCursor source;
+	if (cursorSeek(&source, rope, 0) == 0)
+		errorOccurred();
+	ropeSize leftLength = rope->leftLen;
+	retVal->leftLen = leftLength;
+	retVal->leftLines = rope->leftLines;
+	retVal->leftChars = rope->leftChars;
+	retVal->left = rebuildNodes(arena, &source, nodeSize, leaves, &leftLength);
+	updateHeight(retVal);
+	return retVal;
+}
+
+// Part of a parallel rebuild: the subtree of leaves from firstLeaf on, read from rope
+struct rebuildTask {
+	struct node* rope;
+	int nodeSize;
+	ropeSize firstLeaf;
+	ropeSize leaves;
+	ropeSize length; // Number of characters in the leaves
+	int threads; // Number of threads that may build the subtree, this one included
+	struct node* result;
+};
+
+// Builds the subtree of a rebuildTask, the shape is the same as with rebuildNodes
+// The right half is given to a new thread as long as there are threads left, so the threads build
+// disjoint subtrees and read disjoint parts of the rope, and the halves are attached when both are ready
+// Nodes are allocated with malloc, which unlike an arena may be used by several threads at once
+void* rebuildPart (void* arg) {
+	struct rebuildTask* task = arg;
+	if (task->threads > 1 && task->leaves > 1) {
+		ropeSize leftLeaves = task->leaves - task->leaves / 2;
+		ropeSize leftLength = rebuildLeafStart(task->rope, task->firstLeaf + leftLeaves, task->nodeSize)
+		  - rebuildLeafStart(task->rope, task->firstLeaf, task->nodeSize);
+		struct rebuildTask right = {task->rope, task->nodeSize, task->firstLeaf + leftLeaves,
+		  task->leaves / 2, task->length - leftLength, task->threads / 2, NULL};
+		struct rebuildTask left = {task->rope, task->nodeSize, task->firstLeaf,
+		  leftLeaves, leftLength, task->threads - task->threads / 2, NULL};
+		struct node* n = initNode(0);
+		if (n == NULL)
+			errorOccurred();
+		pthread_t thread;
+		short started = pthread_create(&thread, NULL, rebuildPart, &right) == 0;
+		rebuildPart(&left);
+		if (started)
+			pthread_join(thread, NULL);
+		else
+			rebuildPart(&right); // No thread for it, build it here
+		task->result = attach(n, left.result, right.result, leftLength, subtreeLines(left.result), subtreeChars(left.result));
+		return NULL;
+	}
+	struct ropeCursor source;
+	if (cursorSeek(&source, task->rope, rebuildLeafStart(task->rope, task->firstLeaf, task->nodeSize)) == 0)
+		errorOccurred();
+	ropeSize lengthLeft = task->length;
+	task->result = rebuildNodes(NULL, &source, task->nodeSize, task->leaves, &lengthLeft);
+	return NULL;
+}
+
+// Makes a balanced copy of the whole rope like rebuild, but with up to the given number of threads
+// The copy is the same as from rebuild, except that its nodes are always allocated with malloc
+// The original rope is only read, so it must not be changed until the copy is ready
+// If there is no data in the rope, the original rope is returned and not copied
+struct node* rebuildParallel (struct node* rope, const int nodeSize, const int threads) {
+	if (rope == NULL || rope->leftLen < 0 || nodeSize <= 0 || threads <= 0) {
+		currentError = PARAM;
+		errorOccurred();
+	}
+	if (rope->leftLen == 0)
+		return rope; // Empty rope
+	struct node* retVal = initNode(0);
+	if (retVal == NULL)
+		errorOccurred();
+	struct rebuildTask task = {rope, nodeSize, 0, (rope->leftLen + nodeSize - 1) / nodeSize,
+	  rope->leftLen, threads, NULL};
+	rebuildPart(&task);
+	retVal->leftLen = rope->leftLen;
+	retVal->leftLines = subtreeLines(task.result); // The view of ropeFromBuffer has no counts
+	retVal->leftChars = subtreeChars(task.result);
+	retVal->left = task.result;
+	updateHeight(retVal);
+	return retVal;
+}
+
+// Gathers recursively the non-empty leaves of a subtree in order for rebalanceRope
+// Each gathered leaf gets a new reference, so that it survives when the old subtree is freed
+void gatherLeaves (struct node* n, struct node** leaves, int* count) {
+	if (n->left == NULL && n->right == NULL) {
+		if (n->leftLen > 0) {
+			n->refs++;
+			leaves[(*count)++] = n;
+		}
+		return;
+	}
+	if (n->left != NULL)
+		gatherLeaves(n->left, leaves, count);
+	if (n->right != NULL)
+		gatherLeaves(n->right, leaves, count);
+}
+
+// Links recursively leaves[0..count-1] into a perfectly balanced subtree for rebalanceRope
+// offsets[k] is the number of characters before leaves[k], and offsets[count] the number after the last one
+// The internal nodes are allocated from arena, or with malloc if arena is NULL
+struct node* linkLeaves (struct ropeArena* arena, struct node** leaves, const ropeSize* offsets, const int count) {
+	if (count == 1)
+		return leaves[0];
+	int half = count - count / 2;
+	struct node* n = initNodeIn(arena, 0);
+	if (n == NULL)
+		errorOccurred();
+	struct node* left = linkLeaves(arena, leaves, offsets, half);
+	struct node* right = linkLeaves(arena, leaves + half, offsets + half, count - half);
+	return attach(n, left, right, offsets[half] - offsets[0], subtreeLines(left), subtreeChars(left));
+}
+
+// Rebalances the rope in place: the leaves are kept as they are, without copying any characters,
+// and the internal nodes are rebuilt so that the tree has the least possible height
+// Returns the rope
+struct node* rebalanceRope (struct node* rope) {
+	if (rope == NULL) {
+		currentError = PARAM;
+		return rope;
+	}
+	if (rope->left == NULL)
+		return rope;
+	ropeChanged(rope);
+	struct ropeStats stats;
+	ropeStats(rope, &stats);
+	struct node** leaves = malloc(stats.leaves * sizeof(struct node*));
+	ropeSize* offsets = malloc((stats.leaves + 1) * sizeof(ropeSize));
+	if (leaves == NULL || offsets == NULL) { // The rope is untouched
+		free (leaves);
+		free (offsets);
+		currentError = ALLOC;
+		return rope;
+	}
+	int count = 0;
+	gatherLeaves(rope->left, leaves, &count);
+	freeAll(rope->left); // Frees the internal nodes that no snapshot shares
+	rope->left = NULL;
+	offsets[0] = 0;
+	for (int k = 0; k < count; k++)
+		offsets[k + 1] = offsets[k] + leaves[k]->leftLen;
+	if (count > 0)
+		rope->left = linkLeaves(arenaOf(rope), leaves, offsets, count);
+	updateHeight(rope);
+	free (leaves);
+	free (offsets);
+	return rope;
+}
+
+// Largest leaf of the view that ropeFromBuffer reads the buffer through
+#define ROPE_VIEW_SIZE (1 << 30)
+
+// Makes a balanced rope of length characters from the buffer, with up to the given number of threads
+// The leaves get nodeSize characters, except possibly the last one, and the nodes are allocated with malloc
+// The buffer is not needed after the call
+struct node* ropeFromBuffer (const char* buffer, const ropeSize length, const int nodeSize, const int threads) {
+	if ((buffer == NULL && length > 0) || length < 0) {
+		currentError = PARAM;
+		errorOccurred();
+	}
+	if (length == 0)
+		return initNode(0);
+	// The buffer is read through a rope of leaves that refer to it, so nothing is copied twice
+	// The view leaves have an extra reference, so freeing the view frees only the nodes that link them
+	int count = (length + ROPE_VIEW_SIZE - 1) / ROPE_VIEW_SIZE;
+	struct node* views = calloc(count, sizeof(struct node));
+	struct node** leaves = malloc(count * sizeof(struct node*));
+	ropeSize* offsets = malloc((count + 1) * sizeof(ropeSize));
+	if (views == NULL || leaves == NULL || offsets == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	offsets[0] = 0;
+	for (int k = 0; k < count; k++) {
+		offsets[k + 1] = sizeMin(offsets[k] + ROPE_VIEW_SIZE, length);
+		views[k] = (struct node) {.data = (char*) buffer + offsets[k], .leftLen = offsets[k + 1] - offsets[k],
+		  .textClass = ARENA_NO_TEXT, .refs = 2};
+		leaves[k] = views + k;
+	}
+	struct node view = {.leftLen = length, .textClass = ARENA_NO_TEXT, .refs = 1,
+	  .left = linkLeaves(NULL, leaves, offsets, count)};
+	updateHeight(&view);
+	struct node* rope = rebuildParallel(&view, nodeSize, threads);
+	freeAll(view.left);
+	free (views);
+	free (leaves);
+	free (offsets);
+	return rope;
+}
+
+// Maps the whole file read-only as a shared text with one reference
+// An empty file gives a text without characters
+// Returns NULL if the file cannot be opened or mapped
+struct sharedText* mapFile (const char* path) {
+	struct sharedText* text = calloc(1, sizeof(struct sharedText));
+	if (text == NULL) {
+		currentError = ALLOC;
+		return NULL;
+	}
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close (fd);
+		free (text);
+		currentError = PARAM;
+		return NULL;
+	}
+	text->refs = 1;
+	text->mapped = 1;
+	text->device = st.st_dev;
+	text->inode = st.st_ino;
+	text->length = st.st_size;
+	if (st.st_size > 0) {
+		text->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text->base == MAP_FAILED) {
+			close (fd);
+			free (text);
+			currentError = ALLOC;
+			return NULL;
+		}
+	}
+	close (fd);
+	return text;
+}
+
+// Makes a balanced rope of count leaves that refer to the text, leaf k has lengths[k] characters from starts[k] on
+// The leaves and the rope are malloc'd, and the caller keeps its own reference to the text
+struct node* ropeOfText (struct sharedText* text, const size_t* starts, const int* lengths, const int count) {
+	struct node* rope = initNode(0);
+	struct node** leaves = malloc(count * sizeof(struct node*));
+	ropeSize* offsets = malloc((count + 1) * sizeof(ropeSize));
+	if (rope == NULL || leaves == NULL || offsets == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	offsets[0] = 0;
+	for (int k = 0; k < count; k++) {
+		offsets[k + 1] = offsets[k] + lengths[k];
+		leaves[k] = initNode(0);
+		if (leaves[k] == NULL)
+			errorOccurred();
+		shareText(leaves[k], text, text->base + starts[k], lengths[k]);
+	}
+	rope->leftLen = offsets[count];
+	if (count > 0)
+		rope->left = linkLeaves(NULL, leaves, offsets, count);
+	rope->leftLines = subtreeLines(rope->left);
+	rope->leftChars = subtreeChars(rope->left);
+	updateHeight(rope);
+	free (leaves);
+	free (offsets);
+	return rope;
+}
+
+// Opens a rope over a file without copying it: the file is mapped read-only and its leaves
+// of about leafSize characters refer to the mapping, so untouched parts cost no anonymous memory
+// A leaf is not ended inside a UTF-8 sequence, and the mapping is read once to count newlines and code points
+// Leaves that are changed get their own copies, and the file itself is never written
+// The mapping is removed when the last leaf that refers to it is freed
+// Returns NULL if the file cannot be opened or mapped, or if it would need more than INT32_MAX leaves
+struct node* ropeFromFile (const char* path, const int leafSize) {
+	if (path == NULL || leafSize <= 0) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct sharedText* text = mapFile(path);
+	if (text == NULL)
+		return NULL;
+	int shortest = (leafSize > 3) ? leafSize - 3 : leafSize; // Leaves end at code point boundaries
+	if (text->length / shortest + 1 > INT32_MAX) {
+		releaseText(text);
+		currentError = PARAM;
+		return NULL;
+	}
+	int capacity = text->length / shortest + 1;
+	size_t* starts = malloc(capacity * sizeof(size_t));
+	int* lengths = malloc(capacity * sizeof(int));
+	if (starts == NULL || lengths == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	int count = 0;
+	for (size_t start = 0; start < text->length; count++) {
+		int length = sizeMin(leafSize, text->length - start);
+		if (start + length < text->length && leafSize > 3)
+			length = codePointBoundary(text->base + start, length);
+		starts[count] = start;
+		lengths[count] = length;
+		start += length;
+	}
+	struct node* rope = ropeOfText(text, starts, lengths, count);
+	releaseText(text); // The leaves have their own references
+	free (starts);
+	free (lengths);
+	return rope;
+}
+
+// Rope file format, in the byte order of the machine:
+// "ROPEFILE", then the leaf bytes, then the index and the footer of the latest save
+// The index has an entry of offset (8 bytes) and length (4 bytes) for each leaf in order, and the footer is
+// the offset of the index, the number of leaves and the length of the rope (8 bytes each) and "ROPEINDX"
+// The rope is rebuilt from the leaves in O(leaves), so the shape of the tree is not stored
+// Leaves may be anywhere in the file, so a save may append only the changed leaves, see appendRope
+#define ROPE_FILE_MAGIC "ROPEFILE"
+#define ROPE_INDEX_MAGIC "ROPEINDX"
+#define ROPE_FOOTER_SIZE 32
+
+// Writes the leaves of the rope and an index of them to the end of the open file, whose length is fileLength
+// Leaves that refer to a mapping of the file itself, given by device and inode, are not written again
+// Returns 1 on success and 0 if writing fails
+short writeRopeIndex (FILE* file, size_t fileLength, struct node* rope, dev_t device, ino_t inode) {
+	struct ropeStats stats;
+	ropeStats(rope, &stats);
+	uint64_t* offsets = malloc((stats.leaves + 1) * sizeof(uint64_t));
+	uint32_t* lengths = malloc((stats.leaves + 1) * sizeof(uint32_t));
+	short ok = offsets != NULL && lengths != NULL;
+	uint64_t count = 0;
+	struct ropeCursor cursor;
+	if (ok && cursorSeek(&cursor, rope, 0) == 0)
+		ok = 0;
+	while (ok && cursor.position < rope->leftLen) {
+		const char* span;
+		int length = cursorSpan(&cursor, &span);
+		struct node* leaf = cursor.leaf;
+		if ((leaf->flags & NODE_SHARED_TEXT) && leaf->text->mapped
+		  && leaf->text->device == device && leaf->text->inode == inode)
+			offsets[count] = leaf->data - leaf->text->base;
+		else {
+			offsets[count] = fileLength;
+			ok = fwrite(span, 1, length, file) == (size_t) length;
+			fileLength += length;
+		}
+		lengths[count++] = length;
+		cursorAdvance(&cursor, length);
+	}
+	uint64_t footer[3] = {fileLength, count, rope->leftLen};
+	for (uint64_t k = 0; ok && k < count; k++)
+		ok = fwrite(&offsets[k], sizeof(uint64_t), 1, file) == 1 && fwrite(&lengths[k], sizeof(uint32_t), 1, file) == 1;
+	if (ok)
+		ok = fwrite(footer, sizeof(footer), 1, file) == 1 && fwrite(ROPE_INDEX_MAGIC, 8, 1, file) == 1;
+	free (offsets);
+	free (lengths);
+	if (!ok)
+		currentError = ALLOC;
+	return ok;
+}
+
+// Saves the rope into a new rope file, which replaces the file at path when it is complete,
+// so a rope that was loaded from the same file stays valid
+// Returns 1 on success and 0 if the file cannot be written
+short saveRope (struct node* rope, const char* path) {
+	if (rope == NULL || path == NULL) {
+		currentError = PARAM;
+		return 0;
+	}
+	char* temporary = malloc(strlen(path) + 5);
+	if (temporary == NULL) {
+		currentError = ALLOC;
+		return 0;
+	}
+	strcpy(temporary, path);
+	strcat(temporary, ".tmp");
+	FILE* file = fopen(temporary, "wb");
+	short ok = file != NULL && fwrite(ROPE_FILE_MAGIC, 8, 1, file) == 1
+	  && writeRopeIndex(file, 8, rope, 0, 0);
+	if (file != NULL && fclose(file) != 0)
+		ok = 0;
+	if (ok)
+		ok = rename(temporary, path) == 0;
+	else
+		remove(temporary);
+	free (temporary);
+	if (!ok)
+		currentError = PARAM;
+	return ok;
+}
+
+// Saves the rope into an existing rope file by appending the leaves that are not in the file yet and a new index
+// Leaves of a rope loaded from the file that have not been changed are not written again,
+// so saving an edited rope costs about the size of the edits
+// Returns 1 on success and 0 if the file is not a rope file or cannot be written
+short appendRope (struct node* rope, const char* path) {
+	if (rope == NULL || path == NULL) {
+		currentError = PARAM;
+		return 0;
+	}
+	FILE* file = fopen(path, "r+b");
+	if (file == NULL) {
+		currentError = PARAM;
+		return 0;
+	}
+	struct stat st;
+	char magic[8];
+	short ok = fstat(fileno(file), &st) == 0 && st.st_size >= 8 + ROPE_FOOTER_SIZE
+	  && fread(magic, 8, 1, file) == 1 && memcmp(magic, ROPE_FILE_MAGIC, 8) == 0
+	  && fseek(file, 0, SEEK_END) == 0
+	  && writeRopeIndex(file, st.st_size, rope, st.st_dev, st.st_ino);
+	if (fclose(file) != 0)
+		ok = 0;
+	if (!ok)
+		currentError = PARAM;
+	return ok;
+}
+
+// Loads a rope from a rope file by mapping it, so only the index is read
+// The leaves refer to the mapping like in ropeFromFile
+// Returns NULL if the file is not a rope file or cannot be mapped
+struct node* loadRope (const char* path) {
+	if (path == NULL) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct sharedText* text = mapFile(path);
+	if (text == NULL)
+		return NULL;
+	struct node* rope = NULL;
+	size_t* starts = NULL;
+	int* lengths = NULL;
+	uint64_t footer[3];
+	if (text->length < 8 + ROPE_FOOTER_SIZE || memcmp(text->base, ROPE_FILE_MAGIC, 8) != 0
+	  || memcmp(text->base + text->length - 8, ROPE_INDEX_MAGIC, 8) != 0)
+		goto errorInLoadRope;
+	memcpy(footer, text->base + text->length - ROPE_FOOTER_SIZE, sizeof(footer));
+	uint64_t indexOffset = footer[0], count = footer[1];
+	if (indexOffset > text->length - ROPE_FOOTER_SIZE || count > INT32_MAX
+	  || count * 12 != text->length - ROPE_FOOTER_SIZE - indexOffset)
+		goto errorInLoadRope;
+	starts = malloc((count + 1) * sizeof(size_t));
+	lengths = malloc((count + 1) * sizeof(int));
+	if (starts == NULL || lengths == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	const char* entry = text->base + indexOffset;
+	for (uint64_t k = 0; k < count; k++, entry += 12) {
+		uint64_t offset;
+		uint32_t length;
+		memcpy(&offset, entry, sizeof(offset));
+		memcpy(&length, entry + 8, sizeof(length));
+		if (offset < 8 || length > INT32_MAX || length > indexOffset || offset > indexOffset - length) // No wrap-around
+			goto errorInLoadRope;
+		starts[k] = offset;
+		lengths[k] = length;
+	}
+	rope = ropeOfText(text, starts, lengths, count);
+	if (rope != NULL && (uint64_t) rope->leftLen != footer[2]) {
+		freeAll(rope);
+		rope = NULL;
+		goto errorInLoadRope;
+	}
+	releaseText(text);
+	free (starts);
+	free (lengths);
+	return rope;
+	
+	errorInLoadRope:
+	currentError = PARAM;
+	releaseText(text);
+	free (starts);
+	free (lengths);
+	return NULL;
+}
+
+// One edit of applyBatch: at index position, deleteLength characters are deleted
+// and then length characters of data are inserted, starting from one like insert and delete
+struct ropeEdit {
+	ropeSize position;
+	ropeSize deleteLength;
+	const char* data;
+	int length;
+};
+
+#define BATCH_LEAF_SIZE LEAF_MAX_SIZE // Largest leaf that applyBatch makes from new and partly kept characters
+
+// Leaves of the result of applyBatch, in order
+struct batchLeaves {
+	struct ropeArena* arena;
+	struct node** leaves;
+	int count;
+	int capacity;
+	char pending[BATCH_LEAF_SIZE]; // Characters of the next new leaf
+	int pendingLen;
+	short lastNew; // Whether the last leaf was made of pending characters, and not kept
+};
+
+// Appends a leaf to the result of applyBatch
+void batchPush (struct batchLeaves* out, struct node* leaf) {
+	if (out->count == out->capacity) {
+		int capacity = out->capacity == 0 ? 64 : 2 * out->capacity;
+		struct node** p = realloc(out->leaves, capacity * sizeof(struct node*));
+		if (p == NULL) {
+			currentError = ALLOC;
+			errorOccurred();
+		}
+		out->leaves = p;
+		out->capacity = capacity;
+	}
+	out->leaves[out->count++] = leaf;
+}
+
+// Makes a leaf of the pending characters
+void batchFlush (struct batchLeaves* out) {
+	if (out->pendingLen == 0)
+		return;
+	struct node* leaf = initNodeIn(out->arena, out->pendingLen);
+	if (leaf == NULL)
+		errorOccurred();
+	memcpy(leaf->data, out->pending, out->pendingLen);
+	countLeaf(leaf);
+	out->pendingLen = 0;
+	batchPush(out, leaf);
+	out->lastNew = 1;
+}
+
+// Adds characters to the pending ones, making leaves of BATCH_LEAF_SIZE characters when there are enough
+void batchAppend (struct batchLeaves* out, const char* data, int length) {
+	while (length > 0) {
+		int step = myMin(length, BATCH_LEAF_SIZE - out->pendingLen);
+		memcpy(out->pending + out->pendingLen, data, step);
+		out->pendingLen += step;
+		data += step;
+		length -= step;
+		if (out->pendingLen == BATCH_LEAF_SIZE) { // A sequence cut at the end goes to the next leaf
+			int cut = codePointBoundary(out->pending, BATCH_LEAF_SIZE);
+			out->pendingLen = cut;
+			batchFlush(out);
+			memmove(out->pending, out->pending + cut, BATCH_LEAF_SIZE - cut);
+			out->pendingLen = BATCH_LEAF_SIZE - cut;
+		}
+	}
+}
+
+// Makes a leaf of the pending characters at the end of a part that applyBatch rewrites
+// If they are fewer than LEAF_MIN_SIZE, they first take characters from the end of the new leaf before them,
+// so that the two leaves get about the same number and no short leaf is left between the untouched parts
+void batchFinish (struct batchLeaves* out) {
+	if (out->pendingLen > 0 && out->pendingLen < LEAF_MIN_SIZE && out->count > 0 && out->lastNew
+	  && out->leaves[out->count - 1]->leftLen > out->pendingLen) {
+		struct node* leaf = out->leaves[out->count - 1];
+		int cut = codePointBoundary(leaf->data, (leaf->leftLen + out->pendingLen) / 2);
+		int moved = leaf->leftLen - cut;
+		memmove(out->pending + moved, out->pending, out->pendingLen);
+		memcpy(out->pending, leaf->data + cut, moved);
+		out->pendingLen += moved;
+		leaf->leftLen = cut;
+		countLeaf(leaf);
+	}
+	batchFlush(out);
+}
+
+// Adds count characters from the cursor to the result and moves the cursor past them
+// Leaves that are kept whole are shared with the original rope instead of being copied, except a leaf
+// shorter than LEAF_MIN_SIZE or one that fits after the pending characters: those are packed with them,
+// so the short leaves left around the edits are merged by the next batch and the rope does not fragment
+void batchKeep (struct batchLeaves* out, struct ropeCursor* cursor, ropeSize count) {
+	while (count > 0) {
+		const char* span;
+		int available = cursorSpan(cursor, &span);
+		if (available == 0) { // leftLen does not match the leaves
+			currentError = INTERNAL;
+			errorOccurred();
+		}
+		if (cursor->index == 0 && available <= count && available >= LEAF_MIN_SIZE
+		  && (out->pendingLen == 0 || out->pendingLen + available > BATCH_LEAF_SIZE)) {
+			batchFlush(out);
+			cursor->leaf->refs++;
+			batchPush(out, cursor->leaf);
+			out->lastNew = 0;
+		}
+		else
+			batchAppend(out, span, sizeMin(available, count));
+		count -= cursorAdvance(cursor, sizeMin(available, count));
+	}
+}
+
+// Orders edits by position, and edits at the same position in the order they were given
+int compareEdits (const void* a, const void* b) {
+	const struct ropeEdit* const* x = a;
+	const struct ropeEdit* const* y = b;
+	if ((*x)->position != (*y)->position)
+		return (*x)->position < (*y)->position ? -1 : 1;
+	return (*x < *y) ? -1 : (*x > *y);
+}
+
+// Links the leaves of the result of applyBatch into a balanced subtree, sets *length to the number of
+// characters in them and empties the list
+// Returns NULL if there are no leaves
+struct node* batchLink (struct batchLeaves* out, ropeSize* length) {
+	*length = 0;
+	if (out->count == 0)
+		return NULL;
+	ropeSize* offsets = malloc((out->count + 1) * sizeof(ropeSize));
+	if (offsets == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	offsets[0] = 0;
+	for (int k = 0; k < out->count; k++)
+		offsets[k + 1] = offsets[k] + out->leaves[k]->leftLen;
+	struct node* t = linkLeaves(out->arena, out->leaves, offsets, out->count);
+	*length = offsets[out->count];
+	free (offsets);
+	out->count = 0;
+	return t;
+}
+
+// Part of the rope that applyBatch rewrites for the edits from first on: whole leaves from start to end,
+// starting from zero, end not included
+struct batchPart {
+	ropeSize start;
+	ropeSize end;
+	int first;
+};
+
+// Sets *start and *end to the leaves that an edit changes, and the leaf before an insert, so that the
+// new characters are packed with the characters around them
+void batchWindow (struct node* rope, const struct ropeEdit* e, ropeSize* start, ropeSize* end) {
+	*start = *end = 0;
+	if (rope->leftLen == 0)
+		return;
+	ropeSize first = (e->position > 1) ? e->position - 2 : 0; // Indexes from zero
+	ropeSize last = e->position + e->deleteLength - 2;
+	if (last < first)
+		last = first;
+	leafAt(rope, first, start);
+	struct node* leaf = leafAt(rope, last, end);
+	*end += leaf->leftLen;
+}
+
+// Cuts the first length characters from the front of the subtree *rest, which has *restLength characters
+// Returns them as a subtree, or NULL if length is zero, and *rest is left with the other characters
+// *partLines and *partChars are set to the newlines and code points of the returned subtree
+struct node* batchCut (struct node** rest, const ropeSize length, const ropeSize restLength, ropeSize* partLines, ropeSize* partChars) {
+	struct node* part = *rest;
+	*partLines = *partChars = 0;
+	if (length == 0)
+		return NULL;
+	if (length == restLength) {
+		*rest = NULL;
+		*partLines = subtreeLines(part);
+		*partChars = subtreeChars(part);
+	}
+	else if (splitTree(part, length, &part, rest, partLines, partChars) == 0)
+		errorOccurred();
+	return part;
+}
+
+// Joins part, which has length characters, lines newlines and chars code points, to the end of the rope
+void batchJoin (struct node* rope, struct node* part, const ropeSize length, const ropeSize lines, const ropeSize chars) {
+	if (part == NULL)
+		return;
+	struct node* n = initNodeIn(arenaOf(rope), 0);
+	if (n == NULL)
+		errorOccurred();
+	rope->left = joinWith(rope->left, part, rope->leftLen, rope->leftLines, rope->leftChars, n);
+	rope->leftLen += length;
+	rope->leftLines += lines;
+	rope->leftChars += chars;
+}
+
+// Applies count edits to the rope, and returns the rope
+// The positions of all edits refer to the rope before the batch, so the caller does not adjust them,
+// and the deleted ranges must not overlap
+// The rope is cut with splitTree around each edit at leaf boundaries, the leaves there are rewritten with
+// the new characters, and the parts are joined back with joinWith, so a batch of k edits takes O(k log n)
+// and the untouched parts of the rope are not visited.  The new characters and the rest of the rewritten
+// leaves are packed into leaves of BATCH_LEAF_SIZE characters without cutting UTF-8 sequences, see batchKeep,
+// and a rewritten part shorter than LEAF_MIN_SIZE takes the next leaf with it, so the rope does not fragment
+// If an edit is out of the rope or the deleted ranges overlap, nothing is changed and currentError is PARAM
+struct node* applyBatch (struct node* rope, const struct ropeEdit* edits, const int count) {
+	if (rope == NULL || count < 0 || (edits == NULL && count > 0)) {
+		currentError = PARAM;
+		return rope;
+	}
+	if (count == 0)
+		return rope;
+	const struct ropeEdit** order = malloc(count * sizeof(struct ropeEdit*));
+	if (order == NULL) {
+		currentError = ALLOC;
+		return rope;
+	}
+	for (int k = 0; k < count; k++)
+		order[k] = edits + k;
+	qsort(order, count, sizeof(struct ropeEdit*), compareEdits);
+	ropeSize end = 1; // First index that the edits have not deleted
+	for (int k = 0; k < count; k++) {
+		const struct ropeEdit* e = order[k];
+		if (e->position < end || e->deleteLength < 0 || e->length < 0 || (e->data == NULL && e->length > 0)
+		  || e->position + e->deleteLength - 1 > rope->leftLen) {
+			free (order);
+			currentError = PARAM;
+			return rope;
+		}
+		end = e->position + e->deleteLength;
+	}
+	struct batchPart* parts = malloc((count + 1) * sizeof(struct batchPart));
+	struct batchLeaves* out = calloc(1, sizeof(struct batchLeaves));
+	if (parts == NULL || out == NULL) {
+		free (order);
+		free (parts);
+		free (out);
+		currentError = ALLOC;
+		return rope;
+	}
+	ropeChanged(rope);
+	out->arena = arenaOf(rope);
+
+	// The parts are found before the rope is cut: edits whose leaves overlap are rewritten together
+	int partCount = 0;
+	for (int k = 0; k < count; partCount++) {
+		struct batchPart* p = parts + partCount;
+		p->first = k;
+		batchWindow(rope, order[k], &p->start, &p->end);
+		ropeSize change = 0; // Characters inserted minus characters deleted
+		for (;;) {
+			for (; k < count; k++) {
+				ropeSize start, end;
+				batchWindow(rope, order[k], &start, &end);
+				if (k > p->first && start >= p->end)
+					break;
+				p->end = (end > p->end) ? end : p->end;
+				change += order[k]->length - order[k]->deleteLength;
+			}
+			if (p->end - p->start + change >= LEAF_MIN_SIZE || p->end == rope->leftLen)
+				break;
+			ropeSize start;
+			struct node* leaf = leafAt(rope, p->end, &start); // Too short, the next leaf goes with it
+			p->end = start + leaf->leftLen;
+		}
+	}
+	parts[partCount].first = count;
+
+	struct node* rest = rope->left; // The rest of the original rope, which is joined back to the rope part by part
+	ropeSize restStart = 0, restLength = rope->leftLen;
+	rope->left = NULL;
+	rope->leftLen = rope->leftLines = rope->leftChars = 0;
+	for (int g = 0; g <= partCount; g++) {
+		ropeSize length = (g < partCount) ? parts[g].start - restStart : restLength, lines, chars;
+		struct node* part = batchCut(&rest, length, restLength, &lines, &chars);
+		restLength -= length;
+		batchJoin(rope, part, length, lines, chars);
+		if (g == partCount)
+			break;
+		// The leaves of the part are read through a root of their own and packed with the new characters
+		struct node view = {.textClass = ARENA_NO_TEXT, .refs = 1};
+		view.leftLen = parts[g].end - parts[g].start;
+		view.left = batchCut(&rest, view.leftLen, restLength, &view.leftLines, &view.leftChars);
+		restLength -= view.leftLen;
+		restStart = parts[g].end;
+		struct ropeCursor cursor;
+		if (cursorSeek(&cursor, &view, 0) == 0)
+			errorOccurred();
+		for (int k = parts[g].first; k < parts[g + 1].first; k++) {
+			batchKeep(out, &cursor, order[k]->position - 1 - parts[g].start - cursor.position);
+			cursorAdvance(&cursor, order[k]->deleteLength);
+			batchAppend(out, order[k]->data, order[k]->length);
+		}
+		batchKeep(out, &cursor, view.leftLen - cursor.position);
+		batchFinish(out);
+		freeAll(view.left); // The kept leaves have their own references
+		part = batchLink(out, &length);
+		batchJoin(rope, part, length, subtreeLines(part), subtreeChars(part));
+	}
+	free (order);
+	free (parts);
+	free (out->leaves);
+	free (out);
+	updateHeight(rope);
+	return rope;
+}
+
+// B-tree rope
+// A second rope engine with wide nodes.  An inner node has up to WIDE_FANOUT children and the numbers of
+// characters up to the end of each child in one array, so a descent reads a few cache lines per level
+// of a tree that is only about log16 of the leaves high, and a leaf has its characters inline after its header.
+// All leaves are at the same depth, and every inner node except the root has at least WIDE_MIN_FANOUT children.
+// Split and concat join trees of different heights like the binary ropes, in time proportional to the height.
+// The nodes are not shared, so wide ropes have no snapshots.  Indexes are like those of the binary ropes.
+#define WIDE_FANOUT 16
+#define WIDE_MIN_FANOUT (WIDE_FANOUT / 2)
+#define WIDE_NODE_SIZE 1024 // Bytes in a leaf, header included
+#define WIDE_LEAF_SIZE (WIDE_NODE_SIZE - (int) sizeof(struct wideNode)) // Characters in a full leaf
+#define WIDE_LEAF_MIN (WIDE_LEAF_SIZE / 4) // A leaf that shrinks below this takes characters from a neighbour
+
+struct wideNode {
+	int height; // Zero for a leaf
+	int count; // Number of children, or of characters in a leaf
+};
+
+struct wideInner {
+	struct wideNode head;
+	ropeSize ends[WIDE_FANOUT]; // ends[k] is the number of characters in children 0..k
+	struct wideNode* children[WIDE_FANOUT];
+};
+
+struct wideLeaf {
+	struct wideNode head;
+	char data[WIDE_LEAF_SIZE];
+};
+
+struct wideRope {
+	struct wideNode* root; // NULL if the rope is empty
+	ropeSize length;
+};
+
+// Allocates an empty leaf, or an empty inner node of the given height
+// Calls errorOccurred if allocation fails
+struct wideNode* newWideNode (const int height) {
+	struct wideNode* n = malloc(height == 0 ? sizeof(struct wideLeaf) : sizeof(struct wideInner));
+	if (n == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	n->height = height;
+	n->count = 0;
+	return n;
+}
+
+// Frees the subtree
+void freeWideNode (struct wideNode* n) {
+	if (n == NULL)
+		return;
+	if (n->height > 0)
+		for (int k = 0; k < n->count; k++)
+			freeWideNode(((struct wideInner*) n)->children[k]);
+	free (n);
+}
+
+// Returns the number of characters before child k of the inner node
+ropeSize wideStart (const struct wideInner* n, const int k) {
+	return (k == 0) ? 0 : n->ends[k - 1];
+}
+
+// Returns the number of characters in the subtree
+ropeSize wideLength (const struct wideNode* n) {
+	if (n == NULL)
+		return 0;
+	return (n->height == 0) ? n->count : wideStart((const struct wideInner*) n, n->count);
+}
+
+// Returns the child of the inner node that has the character at index pos, the last child if pos is past it
+// All the ends are compared with a fixed loop without branches, which the compiler turns into vector compares
+int wideChild (const struct wideInner* n, const ropeSize pos) {
+	int k = 0;
+	for (int c = 0; c < WIDE_FANOUT - 1; c++)
+		k += (c < n->head.count - 1) & (n->ends[c] <= pos);
+	return k;
+}
+
+// Moves characters or children between the neighbours a and b, which have the same height,
+// so that a keeps the first keep of them and b has the rest, in the same order
+// keep may be the total of both, and then b is left empty
+void wideShift (struct wideNode* a, struct wideNode* b, const int keep) {
+	int moved = (keep > a->count) ? keep - a->count : a->count - keep;
+	if (a->height == 0) {
+		char* x = ((struct wideLeaf*) a)->data, * y = ((struct wideLeaf*) b)->data;
+		if (keep > a->count) { // The first characters of b move to the end of a
+			memcpy(x + a->count, y, moved);
+			memmove(y, y + moved, b->count - moved);
+		}
+		else { // The last characters of a move to the front of b
+			memmove(y + moved, y, b->count);
+			memcpy(y, x + keep, moved);
+		}
+	}
+	else {
+		struct wideInner* x = (struct wideInner*) a, * y = (struct wideInner*) b;
+		if (keep > a->count) {
+			ropeSize base = wideStart(x, a->count), movedLength = y->ends[moved - 1];
+			for (int c = 0; c < moved; c++) {
+				x->children[a->count + c] = y->children[c];
+				x->ends[a->count + c] = base + y->ends[c];
+			}
+			memmove(y->children, y->children + moved, (b->count - moved) * sizeof(struct wideNode*));
+			for (int c = 0; c < b->count - moved; c++)
+				y->ends[c] = y->ends[c + moved] - movedLength;
+		}
+		else {
+			ropeSize base = wideStart(x, keep), movedLength = wideStart(x, a->count) - base;
+			memmove(y->children + moved, y->children, b->count * sizeof(struct wideNode*));
+			for (int c = b->count - 1; c >= 0; c--)
+				y->ends[c + moved] = y->ends[c] + movedLength;
+			for (int c = 0; c < moved; c++) {
+				y->children[c] = x->children[keep + c];
+				y->ends[c] = x->ends[keep + c] - base;
+			}
+		}
+	}
+	b->count += a->count - keep;
+	a->count = keep;
+}
+
+// Inserts a child of length characters at index k of the inner node, which has room for it
+void wideInsertChild (struct wideInner* n, const int k, struct wideNode* child, const ropeSize length) {
+	ropeSize start = wideStart(n, k);
+	memmove(n->children + k + 1, n->children + k, (n->head.count - k) * sizeof(struct wideNode*));
+	memmove(n->ends + k + 1, n->ends + k, (n->head.count - k) * sizeof(ropeSize));
+	n->children[k] = child;
+	n->ends[k] = start + length;
+	n->head.count++;
+	for (int c = k + 1; c < n->head.count; c++)
+		n->ends[c] += length;
+}
+
+// Removes child k from the inner node and returns it
+struct wideNode* wideRemoveChild (struct wideInner* n, const int k) {
+	struct wideNode* child = n->children[k];
+	ropeSize length = n->ends[k] - wideStart(n, k);
+	memmove(n->children + k, n->children + k + 1, (n->head.count - k - 1) * sizeof(struct wideNode*));
+	memmove(n->ends + k, n->ends + k + 1, (n->head.count - k - 1) * sizeof(ropeSize));
+	n->head.count--;
+	for (int c = k; c < n->head.count; c++)
+		n->ends[c] -= length;
+	return child;
+}
+
+// Makes a new inner node with the children a and b
+struct wideNode* wideParent (struct wideNode* a, struct wideNode* b) {
+	struct wideInner* n = (struct wideInner*) newWideNode(a->height + 1);
+	wideInsertChild(n, 0, a, wideLength(a));
+	wideInsertChild(n, 1, b, wideLength(b));
+	return &n->head;
+}
+
+// Inserts a child at index k of the inner node like wideInsertChild, and splits the node in two if it is full
+// Returns the new right half, or NULL if the node was not split
+struct wideNode* wideAddChild (struct wideInner* n, const int k, struct wideNode* child, const ropeSize length) {
+	if (n->head.count < WIDE_FANOUT) {
+		wideInsertChild(n, k, child, length);
+		return NULL;
+	}
+	struct wideInner* half = (struct wideInner*) newWideNode(n->head.height);
+	wideShift(&n->head, &half->head, WIDE_FANOUT - WIDE_FANOUT / 2);
+	if (k <= n->head.count)
+		wideInsertChild(n, k, child, length);
+	else
+		wideInsertChild(half, k - n->head.count, child, length);
+	return &half->head;
+}
+
+// Removes the inner nodes with at most one child and the empty leaves from the top of the subtree
+// Returns the subtree, or NULL if it has no characters
+struct wideNode* wideNormalize (struct wideNode* n) {
+	while (n != NULL && n->count <= 1 && (n->height > 0 || n->count == 0)) {
+		struct wideNode* child = (n->height > 0 && n->count == 1) ? ((struct wideInner*) n)->children[0] : NULL;
+		free (n);
+		n = child;
+	}
+	return n;
+}
+
+// Joins two subtrees into one that has the characters of a before those of b, like joinWith
+// Only the roots of a and b may have fewer than WIDE_MIN_FANOUT children, and the result is the same
+// The subtree with the lower root is joined into the edge of the other one, so the time is proportional
+// to the difference of the heights, and a node that overflows is split on the way up
+struct wideNode* wideJoin (struct wideNode* a, struct wideNode* b) {
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->height > b->height) { // b goes to the right edge of a
+		struct wideInner* n = (struct wideInner*) a;
+		int k = a->count - 1;
+		ropeSize bLength = wideLength(b);
+		struct wideNode* r = wideJoin(n->children[k], b);
+		if (r->height < a->height) {
+			n->children[k] = r;
+			n->ends[k] += bLength;
+			return a;
+		}
+		struct wideInner* grown = (struct wideInner*) r; // The child was split in two
+		ropeSize rightLength = grown->ends[1] - grown->ends[0];
+		n->children[k] = grown->children[0];
+		n->ends[k] += bLength - rightLength;
+		struct wideNode* half = wideAddChild(n, k + 1, grown->children[1], rightLength);
+		free (grown);
+		return (half == NULL) ? a : wideParent(a, half);
+	}
+	if (a->height < b->height) { // a goes to the left edge of b
+		struct wideInner* n = (struct wideInner*) b;
+		ropeSize aLength = wideLength(a);
+		struct wideNode* r = wideJoin(a, n->children[0]);
+		if (r->height < b->height) {
+			n->children[0] = r;
+			for (int c = 0; c < b->count; c++)
+				n->ends[c] += aLength;
+			return b;
+		}
+		struct wideInner* grown = (struct wideInner*) r;
+		ropeSize leftLength = grown->ends[0];
+		n->children[0] = grown->children[1];
+		for (int c = 0; c < b->count; c++)
+			n->ends[c] += aLength - leftLength;
+		struct wideNode* half = wideAddChild(n, 0, grown->children[0], leftLength);
+		free (grown);
+		return (half == NULL) ? b : wideParent(b, half);
+	}
+	int total = a->count + b->count;
+	if (total <= (a->height == 0 ? WIDE_LEAF_SIZE : WIDE_FANOUT)) { // Both fit in a
+		wideShift(a, b, total);
+		free (b);
+		return a;
+	}
+	if (a->height > 0 || a->count < WIDE_LEAF_MIN || b->count < WIDE_LEAF_MIN)
+		wideShift(a, b, total / 2); // Both get at least the minimum
+	return wideParent(a, b);
+}
+
+// Splits the subtree in two so that *left gets the characters before index pos and *right the rest, like splitTree
+// pos may be from zero to the length of the subtree, and an empty part is NULL
+// The nodes on the path are split, and the pieces are joined back to both sides on ascent
+void wideSplitNode (struct wideNode* n, const ropeSize pos, struct wideNode** left, struct wideNode** right) {
+	if (n->height == 0) {
+		*left = n;
+		*right = NULL;
+		if (pos == 0) {
+			*left = NULL;
+			*right = n;
+		}
+		else if (pos < n->count) {
+			*right = newWideNode(0);
+			wideShift(n, *right, pos);
+		}
+		return;
+	}
+	struct wideInner* in = (struct wideInner*) n;
+	int k = wideChild(in, pos);
+	struct wideNode* childLeft, * childRight;
+	wideSplitNode(in->children[k], pos - wideStart(in, k), &childLeft, &childRight);
+	struct wideNode* rest = newWideNode(n->height);
+	wideShift(n, rest, k + 1); // The children after k go to rest
+	n->count = k; // Child k was split above
+	*left = wideJoin(wideNormalize(n), childLeft);
+	*right = wideJoin(childRight, wideNormalize(rest));
+}
+
+// Inserts length characters, at most WIDE_LEAF_SIZE, at index pos of the subtree
+// An index between two leaves goes to the end of the left one, so typing at the end of a leaf fills the leaf
+// Returns the new right sibling if the subtree had to be split, or NULL
+struct wideNode* wideInsertAt (struct wideNode* n, const ropeSize pos, const char* data, const int length) {
+	if (n->height == 0) {
+		char* chars = ((struct wideLeaf*) n)->data;
+		if (n->count + length <= WIDE_LEAF_SIZE) {
+			memmove(chars + pos + length, chars + pos, n->count - pos);
+			memcpy(chars + pos, data, length);
+			n->count += length;
+			return NULL;
+		}
+		struct wideNode* next = newWideNode(0); // The characters after pos go to the next leaf
+		wideShift(n, next, pos);
+		int room = myMin(length, WIDE_LEAF_SIZE - pos);
+		memcpy(chars + pos, data, room);
+		n->count += room;
+		char* nextChars = ((struct wideLeaf*) next)->data;
+		memmove(nextChars + length - room, nextChars, next->count);
+		memcpy(nextChars, data + room, length - room);
+		next->count += length - room;
+		return next;
+	}
+	struct wideInner* in = (struct wideInner*) n;
+	int k = wideChild(in, pos - 1);
+	struct wideNode* sibling = wideInsertAt(in->children[k], pos - wideStart(in, k), data, length);
+	for (int c = k; c < n->count; c++)
+		in->ends[c] += length;
+	if (sibling == NULL)
+		return NULL;
+	ropeSize siblingLength = wideLength(sibling);
+	for (int c = k; c < n->count; c++)
+		in->ends[c] -= siblingLength;
+	return wideAddChild(in, k + 1, sibling, siblingLength);
+}
+
+// Gives child k of the inner node characters or children from a neighbour if it has fewer than the minimum,
+// and merges the two if they fit in one node
+void wideFixChild (struct wideInner* n, const int k) {
+	struct wideNode* child = n->children[k];
+	if (child->count >= (child->height == 0 ? WIDE_LEAF_MIN : WIDE_MIN_FANOUT) || n->head.count == 1)
+		return;
+	int a = (k + 1 < n->head.count) ? k : k - 1; // Children a and a+1 are fixed together
+	struct wideNode* left = n->children[a], * right = n->children[a + 1];
+	int total = left->count + right->count;
+	if (total <= (child->height == 0 ? WIDE_LEAF_SIZE : WIDE_FANOUT)) {
+		wideShift(left, right, total);
+		n->ends[a] = n->ends[a + 1];
+		free (wideRemoveChild(n, a + 1));
+		return;
+	}
+	wideShift(left, right, total / 2);
+	n->ends[a] = wideStart(n, a) + wideLength(left);
+}
+
+// Deletes count characters from index pos of the subtree, they must be inside one leaf
+void wideDeleteAt (struct wideNode* n, const ropeSize pos, const int count) {
+	if (n->height == 0) {
+		char* chars = ((struct wideLeaf*) n)->data;
+		memmove(chars + pos, chars + pos + count, n->count - pos - count);
+		n->count -= count;
+		return;
+	}
+	struct wideInner* in = (struct wideInner*) n;
+	int k = wideChild(in, pos);
+	wideDeleteAt(in->children[k], pos - wideStart(in, k), count);
+	for (int c = k; c < n->count; c++)
+		in->ends[c] -= count;
+	wideFixChild(in, k);
+}
+
+// Builds a subtree of length characters from the buffer, with full leaves and evenly filled inner nodes
+// Returns NULL if length is zero
+struct wideNode* wideBuild (const char* buffer, const ropeSize length) {
+	ropeSize count = (length + WIDE_LEAF_SIZE - 1) / WIDE_LEAF_SIZE;
+	if (count == 0)
+		return NULL;
+	struct wideNode** nodes = malloc(count * sizeof(struct wideNode*));
+	if (nodes == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	for (ropeSize k = 0; k < count; k++) {
+		nodes[k] = newWideNode(0);
+		nodes[k]->count = sizeMin(WIDE_LEAF_SIZE, length - k * WIDE_LEAF_SIZE);
+		memcpy(((struct wideLeaf*) nodes[k])->data, buffer + k * WIDE_LEAF_SIZE, nodes[k]->count);
+	}
+	for (int height = 1; count > 1; height++) { // Each level groups the nodes of the level below
+		ropeSize groups = (count + WIDE_FANOUT - 1) / WIDE_FANOUT, next = 0;
+		for (ropeSize g = 0; g < groups; g++) {
+			struct wideInner* n = (struct wideInner*) newWideNode(height);
+			ropeSize last = count * (g + 1) / groups;
+			for (; next < last; next++)
+				wideInsertChild(n, n->head.count, nodes[next], wideLength(nodes[next]));
+			nodes[g] = &n->head;
+		}
+		count = groups;
+	}
+	struct wideNode* root = nodes[0];
+	free (nodes);
+	return root;
+}
+
+// Creates an empty wide rope
+// Returns NULL if creation fails
+struct wideRope* newWideRope () {
+	struct wideRope* rope = calloc(1, sizeof(struct wideRope));
+	if (rope == NULL)
+		currentError = ALLOC;
+	return rope;
+}
+
+// Frees the wide rope and all of its nodes
+void freeWideRope (struct wideRope* rope) {
+	if (rope == NULL)
+		return;
+	freeWideNode(rope->root);
+	free (rope);
+}
+
+// Makes a wide rope of length characters from the buffer, the buffer is not needed after the call
+// Returns NULL if creation fails
+struct wideRope* wideFromBuffer (const char* buffer, const ropeSize length) {
+	if ((buffer == NULL && length > 0) || length < 0) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct wideRope* rope = newWideRope();
+	if (rope == NULL)
+		return NULL;
+	rope->root = wideBuild(buffer, length);
+	rope->length = length;
+	return rope;
+}
+
+// Returns the kth character, k starts from zero, or NULL if the character does not exist
+char wideKthChar (const struct wideRope* rope, ropeSize k) {
+	if (rope == NULL || k < 0 || k >= rope->length) {
+		currentError = PARAM;
+		return '\0';
+	}
+	const struct wideNode* n = rope->root;
+	while (n->height > 0) {
+		const struct wideInner* in = (const struct wideInner*) n;
+		int c = wideChild(in, k);
+		k -= wideStart(in, c);
+		n = in->children[c];
+	}
+	return ((const struct wideLeaf*) n)->data[k];
+}
+
+// Copies count characters from index skip of the subtree into buffer, like inOrderPick
+void widePick (const struct wideNode* n, ropeSize skip, ropeSize count, char* buffer) {
+	if (n->height == 0) {
+		memcpy(buffer, ((const struct wideLeaf*) n)->data + skip, count);
+		return;
+	}
+	const struct wideInner* in = (const struct wideInner*) n;
+	int c = wideChild(in, skip);
+	skip -= wideStart(in, c);
+	for (; count > 0; c++) {
+		ropeSize picked = sizeMin(count, in->ends[c] - wideStart(in, c) - skip);
+		widePick(in->children[c], skip, picked, buffer);
+		buffer += picked;
+		count -= picked;
+		skip = 0;
+	}
+}
+
+// Collects the characters from index i to j, both included and starting from one, like collect
+char* wideCollect (const struct wideRope* rope, ropeSize i, ropeSize j) {
+	if (rope == NULL || i < 1 || j > rope->length || j < i) {
+		currentError = PARAM;
+		return NULL;
+	}
+	char* nn = malloc ((j - i + 2) * sizeof(char)); // Terminal NULL
+	if (nn == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	nn[j - i + 1] = '\0';
+	widePick(rope->root, i - 1, j - i + 1, nn);
+	return nn;
+}
+
+// Splits the rope like split: the rope keeps the characters before position and the returned rope gets the rest
+// Position starts from zero and must be less than the length of the rope
+// Returns NULL if the position is out of the rope or the new rope cannot be allocated, and then the rope is unchanged
+struct wideRope* wideSplit (struct wideRope* rope, const ropeSize position) {
+	if (rope == NULL || position < 0 || position >= rope->length) {
+		currentError = PARAM;
+		return NULL;
+	}
+	struct wideRope* newRope = newWideRope();
+	if (newRope == NULL)
+		return NULL;
+	struct wideNode* left, * right;
+	wideSplitNode(rope->root, position, &left, &right);
+	rope->root = wideNormalize(left);
+	newRope->root = wideNormalize(right);
+	newRope->length = rope->length - position;
+	rope->length = position;
+	return newRope;
+}
+
+// Appends the characters of right to left and frees right
+// Returns left
+struct wideRope* wideConcat (struct wideRope* left, struct wideRope* right) {
+	if (left == NULL || right == NULL) {
+		currentError = PARAM;
+		return left;
+	}
+	left->root = wideNormalize(wideJoin(left->root, right->root));
+	left->length += right->length;
+	free (right);
+	return left;
+}
+
+// Inserts dataLength bytes into the wide rope, 1..i-1, insertData, i..m like insertBytes
+// Up to WIDE_LEAF_SIZE bytes go into a leaf, which is split if it overflows,
+// and longer data is built into a subtree that is joined between the split parts of the rope
+struct wideRope* wideInsert (struct wideRope* rope, const ropeSize i, const char* insertData, const int dataLength) {
+	if (rope == NULL || i < 1 || i > rope->length + 1 || insertData == NULL || dataLength <= 0) {
+		currentError = PARAM;
+		return rope;
+	}
+	if (dataLength > WIDE_LEAF_SIZE || rope->root == NULL) {
+		struct wideNode* left = NULL, * right = NULL;
+		if (rope->root != NULL)
+			wideSplitNode(rope->root, i - 1, &left, &right);
+		rope->root = wideNormalize(wideJoin(wideJoin(left, wideBuild(insertData, dataLength)), right));
+	}
+	else {
+		struct wideNode* sibling = wideInsertAt(rope->root, i - 1, insertData, dataLength);
+		if (sibling != NULL)
+			rope->root = wideParent(rope->root, sibling);
+	}
+	rope->length += dataLength;
+	return rope;
+}
+
+// Deletes the characters from index i to j, both included and starting from one, like delete
+// A delete inside one leaf changes the leaf in place, and longer ones split the rope at both ends
+struct wideRope* wideDelete (struct wideRope* rope, const ropeSize i, const ropeSize j) {
+	if (rope == NULL || i < 1 || j > rope->length || j < i) {
+		currentError = PARAM;
+		return rope;
+	}
+	const struct wideNode* n = rope->root;
+	ropeSize pos = i - 1;
+	while (n->height > 0) { // Find the leaf of the first character
+		const struct wideInner* in = (const struct wideInner*) n;
+		int c = wideChild(in, pos);
+		pos -= wideStart(in, c);
+		n = in->children[c];
+	}
+	if (pos + (j - i + 1) <= n->count)
+		wideDeleteAt(rope->root, i - 1, j - i + 1);
+	else {
+		struct wideNode* left, * middle, * right;
+		wideSplitNode(rope->root, j, &middle, &right);
+		wideSplitNode(middle, i - 1, &left, &middle);
+		freeWideNode(middle);
+		rope->root = wideJoin(wideNormalize(left), wideNormalize(right));
+	}
+	rope->root = wideNormalize(rope->root);
+	rope->length -= j - i + 1;
+	return rope;
 }
 
+#ifndef ROPE_NO_MAIN // Defined by programs that include the rope, such as RopeBench.c
 int main (int argc, char** argv) {
 	if (argc != 1)
 		errorOccurred (ARGS);
@@ -623,14 +4184,17 @@ int main (int argc, char** argv) {
 	rope = insert (rope, 1, "Building sturdy");
 	rope = insert (rope, 10, "rope ");
 	rope = delete (rope,3,5);
-	printf("%d",rope->leftLen);
+	printf("%lld",(long long) rope->leftLen);
 	printf(" ");
 	printf (" %d ",rope->left);
-	printf (" %d ",rope->left->leftLen);
-	printf (" %d ",rope->left->left);
-	printf (" %d ", rope->left->left->leftLen);
-	printf(" %d ",strlen(rope->left->left->data));
-	printf("%s", rope->left->left->data);
+	printf (" %lld ",(long long) rope->left->leftLen);
+	struct ropeCursor first; // Small inserts went into the same leaf
+	const char* firstData;
+	if (cursorSeek(&first, rope, 0) == 0)
+		errorOccurred ();
+	int firstLen = cursorSpan(&first, &firstData);
+	printf(" %d ", firstLen);
+	printf("%.*s", firstLen, firstData);
 	printf (" %s ", collect(rope, 1, 17));
 	printf (" %s ", collect(rope, 10, 12));
 	struct node* rope1 = rebuild(rope, 3);
@@ -644,13 +4208,66 @@ int main (int argc, char** argv) {
 	rope = delete (rope, 19, 20);
 	printf (" %s ", collect(rope, 1, 18));
 	rope = delete(rope, 1,18);
-	printf (" %d %d %d %d ", rope, rope->leftLen, rope->left, rope->right);
+	printf (" %d %lld %d %d ", rope, (long long) rope->leftLen, rope->left, rope->right);
 	printf (" %s ", collect(rope1, 1, 17));
 	rope1 = insert(rope1, 5, "Bye now");
 	printf (" %s ", collect(rope1, 1, 24));
 	rope1 = delete(rope1, 2,3);
 	printf (" %s ", collect(rope1, 1, 22));
+	int spanCount; // Write rope1 from its leaves
+	struct ropeSpan* spans = collectSpans(rope1, 1, rope1->leftLen, &spanCount);
+	if (spans == NULL)
+		errorOccurred ();
+	for (int k = 0; k < spanCount; k++)
+		fwrite(spans[k].data, 1, spans[k].length, stdout);
+	free (spans);
+	struct ropeCursor cursor; // Print rope1 backwards
+	printf (" ");
+	if (cursorSeek(&cursor, rope1, rope1->leftLen) == 0)
+		errorOccurred ();
+	while (cursorPrev(&cursor))
+		printf ("%c", cursorChar(&cursor));
+	printf (" ");
+	struct node* rope2 = newArenaRope();
+	if (rope2 == NULL)
+		errorOccurred ();
+	rope2 = insert (rope2, 1, "Arena rope");
+	rope2 = insert (rope2, 7, "sturdy ");
+	printf (" %s ", collect(rope2, 1, 17));
+	struct node* version = snapshot(rope2); // The old version survives the edit
+	rope2 = delete (rope2, 1, 6);
+	printf (" %s / %s ", collect(version, 1, 17), collect(rope2, 1, 11));
+	freeAll(version);
+	struct ropeDocument* doc = newDocument(rope2); // The writer publishes, the reader sees a whole version
+	if (doc == NULL)
+		errorOccurred ();
+	int slot = readerSlot(doc);
+	struct node* seen = readBegin(doc, slot);
+	struct node* next = writeBegin(doc);
+	next = insert (next, 1, "Shared ");
+	if (publish(doc, next) == 0)
+		errorOccurred ();
+	printf (" %s / ", collect(seen, 1, seen->leftLen));
+	readEnd(doc, slot);
+	seen = readBegin(doc, slot);
+	printf ("%s ", collect(seen, 1, seen->leftLen));
+	readEnd(doc, slot);
+	releaseReaderSlot(doc, slot);
+	freeDocument(doc);
+	struct node* lines = insert (initNode(0), 1, "first\nsecond\nthird");
+	printf (" line 2 starts at %lld, offset 8 is on line %lld ", (long long) lineToOffset(lines, 2), (long long) offsetToLine(lines, 8));
+	printf (" \"third\" is at %lld ", (long long) ropeFind(lines, "third", 5, 0));
+	freeAll(lines);
+	struct wideRope* wide = newWideRope(); // The first edits again on a B-tree rope
+	if (wide == NULL)
+		errorOccurred ();
+	wide = wideInsert (wide, 1, "Building sturdy", 15);
+	wide = wideInsert (wide, 10, "rope ", 5);
+	wide = wideDelete (wide, 3, 5);
+	printf (" %s ", wideCollect(wide, 1, wide->length));
+	freeWideRope(wide);
 	freeAll(rope);
 	freeAll(rope1);
 	exit(EXIT_SUCCESS);
 }
+#endif
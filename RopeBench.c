@@ -0,0 +1,1168 @@
+// Benchmark and profiling harness for the rope operations
+// Builds a rope of the given size, runs a mix of operations on it and prints one JSON object
+// with the throughput and latency percentiles of each operation, peak RSS, allocation counts and tree shape,
+// so that runs can be stored and compared.  Build and run for example:
+//   gcc -std=gnu11 -O2 -pthread -o RopeBench RopeBench.c
+// Built with -DROPE_COUNTERS, it also prints the counters of the hot paths during the operations
+//   ./RopeBench --engine binary --size 16777216 --leaf 1024 --mix typing --ops 200000
+// --threads sets the threads that ropeFromBuffer builds the binary rope with, the other engines build with one
+// Engines: binary (malloc'd nodes), arena (nodes in the arena of the rope) and wide (the B-tree rope)
+// Mixes:
+//   random      inserts, deletes, collects, kthChar and split+concat at random positions
+//   sequential  the same operations at a position that moves forward through the rope
+//   typing      an editor: single characters typed and erased at a caret that sometimes jumps, lines read around it
+//   append      fingerAppend of short lines, with reads of the tail; with --size 0 it measures an ingest from scratch:
+//                 ./RopeBench --mix append --size 0 --ops 10M
+//   nearby      kthChar and fingerKthChar at a position that moves a little at a time and sometimes jumps,
+//                 so the two are measured at the same positions
+//   fingertyping  the typing mix with the inserts and deletes made through a ropeFinger
+//   cutpaste    moves of a block of --block characters to a random position by split and concat, with kthChar
+//   compare     ropeCompare of the whole rope with an edited snapshot of it, which shares all but one path,
+//                 and with a copy that has other leaves, and ropeHash of the whole rope; not for the wide engine
+//   document    a ropeDocument with --readers threads that read and check 64 characters at random positions
+//                 while the writer publishes an insert or a delete per operation; not for the wide engine
+//   batch       --batch edits at random positions per operation, made on a snapshot one at a time with insert and
+//                 delete, and on the rope with applyBatch, and the results compared; not for the wide engine
+//   large       a check of 64-bit indexes instead of a benchmark, opt-in because it needs more than 4 GiB of index:
+//                 a rope of --size characters is built by doubling a piece with shared subtrees, so it takes
+//                 little memory, and kthChar, collect, lines, code points and ropeFind are checked above 4 GiB,
+//                 and a split above 4 GiB, a delete across 2 GiB and the concat back; then a sparse file of
+//                 --size bytes is opened with ropeFromFile, saved with saveRope and loaded with loadRope, which
+//                 needs --size bytes of free disk in $TMPDIR or /tmp; not for the wide engine
+//                 ./RopeBench --mix large --size 5G
+//   find        ropeFind of a needle planted at the start of every --block characters, from a random position,
+//                 and the same search by collecting the rest of the rope and strstr; not for the wide engine.
+//                 Small and large leaves of a 100 MB rope:
+//                 ./RopeBench --mix find --size 100M --leaf 64 --ops 20000
+//                 ./RopeBench --mix find --size 100M --leaf 65536 --ops 20000
+//   saveload    saveRope and loadRope of a file in $TMPDIR or /tmp, against collecting the text, writing it to a file,
+//                 reading it back and building a rope with ropeFromBuffer; each loaded rope is checked and freed,
+//                 and the mean times and the largest growth of the resident memory by a load are printed too;
+//                 not for the wide engine
+//                 ./RopeBench --mix saveload --size 100M --ops 200
+//   lines       lineToOffset of a random line and offsetToLine of a random offset, on a rope that should be large
+//                 enough that the line counts do not fit in the caches; not for the wide engine
+//                 ./RopeBench --mix lines --size 64M --ops 1M
+//   skewed      a rope built from scratch by inserts of up to 64 characters at the front or at the back, with --ops
+//                 kthChar and collects timed before and after rebalanceRope, and the depth of both trees;
+//                 --leaf is not used; not for the wide engine
+//                 ./RopeBench --mix skewed --size 16M --ops 1M
+
+// The allocation functions of the rope are counted, so the headers that declare them come first
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+atomic_long benchAllocs, benchFrees;
+
+void* benchMalloc (size_t size) {
+	atomic_fetch_add(&benchAllocs, 1);
+	return malloc(size);
+}
+
+void* benchCalloc (size_t count, size_t size) {
+	atomic_fetch_add(&benchAllocs, 1);
+	return calloc(count, size);
+}
+
+void* benchRealloc (void* p, size_t size) {
+	if (p == NULL)
+		atomic_fetch_add(&benchAllocs, 1);
+	return realloc(p, size);
+}
+
+void* benchAlignedAlloc (size_t alignment, size_t size) {
+	atomic_fetch_add(&benchAllocs, 1);
+	return aligned_alloc(alignment, size);
+}
+
+void benchFree (void* p) {
+	if (p != NULL)
+		atomic_fetch_add(&benchFrees, 1);
+	free (p);
+}
+
+#define ROPE_NO_MAIN
+#define malloc(size) benchMalloc(size)
+#define calloc(count, size) benchCalloc(count, size)
+#define realloc(p, size) benchRealloc(p, size)
+#define aligned_alloc(alignment, size) benchAlignedAlloc(alignment, size)
+#define free(p) benchFree(p)
+#include "MyRope.c"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef aligned_alloc
+#undef free
+
+enum BenchEngine {ENGINE_BINARY, ENGINE_ARENA, ENGINE_WIDE};
+enum BenchMix {MIX_RANDOM, MIX_SEQUENTIAL, MIX_TYPING, MIX_APPEND, MIX_NEARBY, MIX_FINGER_TYPING, MIX_CUTPASTE, MIX_COMPARE, MIX_DOCUMENT, MIX_BATCH, MIX_LARGE, MIX_FIND, MIX_SAVELOAD, MIX_LINES, MIX_SKEWED};
+enum BenchOp {OP_INSERT, OP_DELETE, OP_COLLECT, OP_KTHCHAR, OP_SPLIT, OP_APPEND,
+  OP_FINGER_KTHCHAR, OP_FINGER_INSERT, OP_FINGER_DELETE, OP_MOVE,
+  OP_COMPARE_SNAPSHOT, OP_COMPARE_COPY, OP_HASH, OP_PUBLISH,
+  OP_APPLY_BATCH, OP_SEQUENTIAL_EDITS, OP_FIND, OP_COLLECT_STRSTR,
+  OP_SAVE, OP_LOAD, OP_SAVE_TEXT, OP_LOAD_TEXT, OP_LINE_TO_OFFSET, OP_OFFSET_TO_LINE, OP_COUNT};
+
+const char* engineNames[] = {"binary", "arena", "wide"};
+const char* mixNames[] = {"random", "sequential", "typing", "append", "nearby", "fingertyping", "cutpaste", "compare", "document", "batch", "large", "find", "saveload", "lines", "skewed"};
+const char* opNames[] = {"insert", "delete", "collect", "kthChar", "split", "append",
+  "fingerKthChar", "fingerInsert", "fingerDelete", "move",
+  "compareSnapshot", "compareCopy", "hash", "publish",
+  "applyBatch", "sequentialEdits", "find", "collectStrstr",
+  "save", "load", "saveText", "loadText", "lineToOffset", "offsetToLine"};
+// split is split and concat back, move is a cut and paste, publish is writeBegin, an insert or a delete and publish,
+// collectStrstr is the search of find made by collecting the rest of the rope and strstr,
+// saveText collects the rope and writes the text to a file, and loadText reads it and builds a rope with ropeFromBuffer
+
+struct benchOptions {
+	enum BenchEngine engine;
+	enum BenchMix mix;
+	ropeSize size; // Characters in the rope before the operations
+	int leaf; // nodeSize of the leaves that the rope is built with
+	long ops;
+	unsigned long long seed;
+	int threads; // Threads of the build
+	int block; // Characters moved by the cutpaste mix, or between the needles of the find mix
+	int readers; // Reader threads of the document mix
+	int batch; // Edits per operation of the batch mix
+};
+
+// Latencies of one kind of operation
+struct benchSamples {
+	long* ns;
+	long count;
+	double total; // Seconds
+};
+
+// The rope under test, one of the engines
+struct benchRope {
+	enum BenchEngine engine;
+	struct node* rope;
+	struct wideRope* wide;
+	struct ropeFinger finger; // For the finger operations of the binary engines
+	struct node* snapshot; // Of the rope for the compare mix, with the same characters
+	struct node* copy;
+	struct ropeDocument* document; // Of the document mix, which owns the rope
+	ropeSize needles; // Characters between the starts of the needles planted for the find mix
+	int leaf; // nodeSize of the ropes that the saveload mix builds from the text
+	const char* files[2]; // The rope file and the text file of the saveload mix
+	long resident[2]; // Largest growth of the resident memory in KiB by load and by loadText
+};
+
+// A reader thread of the document mix
+struct benchReader {
+	struct ropeDocument* document;
+	pthread_t thread;
+	unsigned long long state; // Random numbers of the reader, xorshift
+	atomic_int* stop;
+	long reads;
+};
+
+unsigned long long benchState;
+
+#define FIND_NEEDLE 16 // Characters of the needle of the find mix, the start of the text, which the random text does not have
+
+// Returns a pseudo-random number, xorshift
+unsigned long long benchRandom () {
+	benchState ^= benchState << 13;
+	benchState ^= benchState >> 7;
+	benchState ^= benchState << 17;
+	return benchState;
+}
+
+double benchNow () {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+ropeSize benchLength (const struct benchRope* r) {
+	return (r->engine == ENGINE_WIDE) ? r->wide->length : r->rope->leftLen;
+}
+
+// Returns the resident memory of the process in KiB, or 0 if it is not known
+long benchResident () {
+	long pages = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file != NULL) {
+		if (fscanf(file, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(file);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Reports a wrong result of the rope and exits
+void benchMismatch (const char* function) {
+	fprintf(stderr, "RopeBench: wrong result from %s\n", function);
+	exit(EXIT_FAILURE);
+}
+
+// Joins the rope split off from r back to its end, for the split operation of the binary engines
+void benchJoin (struct node* r, struct node* right) {
+	struct node* n = concat(r->left, right->left, r->leftLen, r->leftLines, r->leftChars);
+	if (n == NULL)
+		errorOccurred();
+	ropeChanged(r);
+	r->left = n;
+	r->leftLen += right->leftLen;
+	r->leftLines += right->leftLines;
+	r->leftChars += right->leftChars;
+	updateHeight(r);
+	freeNode(right);
+}
+
+// Runs one operation on the rope at index pos, starting from zero
+// length is the number of characters inserted, deleted or collected
+void benchRun (struct benchRope* r, const enum BenchOp op, const ropeSize pos, const int length, const char* text) {
+	ropeSize total = benchLength(r);
+	volatile char sink = 0;
+	if (r->engine == ENGINE_WIDE) {
+		switch (op) {
+			case OP_INSERT:
+			r->wide = wideInsert(r->wide, pos + 1, text, length);
+			break;
+			case OP_DELETE:
+			r->wide = wideDelete(r->wide, pos + 1, pos + length);
+			break;
+			case OP_COLLECT:
+			free (wideCollect(r->wide, pos + 1, pos + length));
+			break;
+			case OP_KTHCHAR:
+			sink = wideKthChar(r->wide, pos);
+			break;
+			case OP_SPLIT:
+			r->wide = wideConcat(r->wide, wideSplit(r->wide, pos));
+			break;
+			case OP_APPEND: // The wide rope has no append of its own
+			r->wide = wideInsert(r->wide, total + 1, text + 64 - length, length);
+			break;
+			case OP_FINGER_KTHCHAR: // Nor fingers, the finger operations are the plain ones
+			sink = wideKthChar(r->wide, pos);
+			break;
+			case OP_FINGER_INSERT:
+			r->wide = wideInsert(r->wide, pos + 1, text, length);
+			break;
+			case OP_FINGER_DELETE:
+			r->wide = wideDelete(r->wide, pos + 1, pos + length);
+			break;
+			case OP_MOVE:
+			if (pos > 0 && pos + length < total) {
+				struct wideRope* block = wideSplit(r->wide, pos);
+				r->wide = wideConcat(r->wide, wideSplit(block, length));
+				struct wideRope* tail = wideSplit(r->wide, 1 + benchRandom() % (total - length - 1));
+				r->wide = wideConcat(wideConcat(r->wide, block), tail);
+			}
+			break;
+			default:
+			break;
+		}
+		(void) sink;
+		return;
+	}
+	switch (op) {
+		case OP_INSERT:
+		r->rope = insertBytes(r->rope, pos + 1, text, length);
+		break;
+		case OP_DELETE:
+		r->rope = delete(r->rope, pos + 1, pos + length);
+		break;
+		case OP_COLLECT:
+		free (collect(r->rope, pos + 1, pos + length));
+		break;
+		case OP_KTHCHAR:
+		sink = kthChar(r->rope, pos);
+		break;
+		case OP_SPLIT:
+		if (pos > 0 && pos < total)
+			benchJoin(r->rope, split(r->rope, pos));
+		break;
+		case OP_APPEND:
+		r->rope = fingerAppend(&r->finger, r->rope, text + 64 - length, length);
+		break;
+		case OP_FINGER_KTHCHAR:
+		sink = fingerKthChar(&r->finger, r->rope, pos);
+		break;
+		case OP_FINGER_INSERT:
+		r->rope = fingerInsert(&r->finger, r->rope, pos + 1, text, length);
+		break;
+		case OP_FINGER_DELETE:
+		r->rope = fingerDelete(&r->finger, r->rope, pos + 1, pos + length);
+		break;
+		case OP_COMPARE_SNAPSHOT:
+		if (ropeCompare(r->rope, r->snapshot) != 0)
+			benchMismatch("ropeCompare");
+		break;
+		case OP_COMPARE_COPY:
+		if (ropeCompare(r->rope, r->copy) != 0)
+			benchMismatch("ropeCompare");
+		break;
+		case OP_HASH:
+		sink = ropeHash(r->rope, 0);
+		break;
+		case OP_PUBLISH: {
+			struct node* version = writeBegin(r->document);
+			if (version == NULL)
+				errorOccurred();
+			if (benchRandom() % 2 == 0)
+				version = insertBytes(version, pos + 1, text, length);
+			else
+				version = delete(version, pos + 1, pos + length);
+			if (publish(r->document, version) == 0)
+				errorOccurred();
+			r->rope = version;
+			break;
+		}
+		case OP_FIND: // Both searches must find the first needle at or after pos
+		case OP_COLLECT_STRSTR: {
+			ropeSize found = -1, next = (pos + r->needles - 1) / r->needles * r->needles;
+			if (op == OP_FIND)
+				found = ropeFind(r->rope, text, FIND_NEEDLE, pos);
+			else {
+				char needle[FIND_NEEDLE + 1];
+				memcpy(needle, text, FIND_NEEDLE);
+				needle[FIND_NEEDLE] = '\0';
+				char* chars = collect(r->rope, pos + 1, total);
+				if (chars == NULL)
+					errorOccurred();
+				char* match = strstr(chars, needle);
+				if (match != NULL)
+					found = pos + (match - chars);
+				free (chars);
+			}
+			if (found != ((next + FIND_NEEDLE <= total) ? next : -1))
+				benchMismatch(opNames[op]);
+			break;
+		}
+		case OP_SAVE:
+		if (saveRope(r->rope, r->files[0]) == 0)
+			errorOccurred();
+		break;
+		case OP_SAVE_TEXT: {
+			char* chars = collect(r->rope, 1, total);
+			if (chars == NULL)
+				errorOccurred();
+			FILE* file = fopen(r->files[1], "wb");
+			if (file == NULL || fwrite(chars, 1, total, file) != (size_t) total || fclose(file) != 0) {
+				fprintf(stderr, "RopeBench: cannot write %s\n", r->files[1]);
+				exit(1);
+			}
+			free (chars);
+			break;
+		}
+		case OP_LOAD: // The loaded rope is checked at pos, which reads one page of a mapped file
+		case OP_LOAD_TEXT: {
+			long before = benchResident(), grown;
+			struct node* loaded;
+			if (op == OP_LOAD) {
+				loaded = loadRope(r->files[0]);
+				grown = benchResident() - before;
+			}
+			else {
+				char* chars = malloc(total);
+				FILE* file = fopen(r->files[1], "rb");
+				if (chars == NULL || file == NULL || fread(chars, 1, total, file) != (size_t) total) {
+					fprintf(stderr, "RopeBench: cannot read %s\n", r->files[1]);
+					exit(1);
+				}
+				fclose(file);
+				loaded = ropeFromBuffer(chars, total, r->leaf, 1);
+				grown = benchResident() - before; // With the text still read
+				free (chars);
+			}
+			if (loaded == NULL)
+				errorOccurred();
+			if (loaded->leftLen != total || kthChar(loaded, pos) != kthChar(r->rope, pos))
+				benchMismatch(opNames[op]);
+			freeAll(loaded);
+			if (grown > r->resident[op == OP_LOAD_TEXT])
+				r->resident[op == OP_LOAD_TEXT] = grown;
+			break;
+		}
+		case OP_LINE_TO_OFFSET: // pos picks one of the leftLines + 1 lines
+		sink = (char) lineToOffset(r->rope, pos % (r->rope->leftLines + 1));
+		break;
+		case OP_OFFSET_TO_LINE:
+		sink = (char) offsetToLine(r->rope, pos);
+		break;
+		case OP_MOVE: // The block from pos is cut and pasted at a random position of the rest
+		if (pos > 0 && pos + length < total) {
+			struct node* block = split(r->rope, pos);
+			benchJoin(r->rope, split(block, length));
+			struct node* tail = split(r->rope, 1 + benchRandom() % (total - length - 1));
+			benchJoin(r->rope, block);
+			benchJoin(r->rope, tail);
+		}
+		break;
+		default:
+		break;
+	}
+	(void) sink;
+}
+
+// Picks the next operation of the mix, its position and length
+// caret is the position that sequential, typing and append mixes work at, and block the length of a move
+enum BenchOp benchNext (const enum BenchMix mix, const ropeSize total, const int block, ropeSize* caret, ropeSize* pos, int* length) {
+	unsigned long long dice = benchRandom() % 100;
+	enum BenchOp op;
+	switch (mix) {
+		case MIX_TYPING:
+		case MIX_FINGER_TYPING:
+		if (dice < 1) // Jump somewhere else
+			*caret = benchRandom() % (total + 1);
+		*length = 1;
+		if (dice < 90 || *caret == 0) { // Type a character
+			op = OP_INSERT;
+			*pos = (*caret)++;
+		}
+		else if (dice < 98) { // Backspace
+			op = OP_DELETE;
+			*pos = --*caret;
+		}
+		else { // Read the line around the caret
+			op = OP_COLLECT;
+			*length = 80;
+			*pos = *caret;
+		}
+		if (mix == MIX_FINGER_TYPING && op != OP_COLLECT)
+			op = (op == OP_INSERT) ? OP_FINGER_INSERT : OP_FINGER_DELETE;
+		break;
+		case MIX_NEARBY:
+		if (dice < 1) // Jump somewhere else
+			*caret = benchRandom() % (total + 1);
+		else { // Move up to 64 characters either way
+			ropeSize step = benchRandom() % 129;
+			*caret = sizeMin((*caret + step < 64) ? 0 : *caret + step - 64, total);
+		}
+		op = (benchRandom() % 2 == 0) ? OP_KTHCHAR : OP_FINGER_KTHCHAR;
+		*length = 1;
+		*pos = *caret;
+		break;
+		case MIX_CUTPASTE:
+		op = (dice < 90) ? OP_MOVE : OP_KTHCHAR;
+		*length = (op == OP_MOVE) ? block : 1;
+		*pos = (total > *length + 1) ? 1 + benchRandom() % (total - *length - 1) : 0; // A move needs characters on both sides
+		break;
+		case MIX_COMPARE:
+		op = (dice < 34) ? OP_COMPARE_SNAPSHOT : (dice < 67) ? OP_COMPARE_COPY : OP_HASH;
+		*length = 0;
+		*pos = 0;
+		break;
+		case MIX_DOCUMENT:
+		op = OP_PUBLISH;
+		*length = 1 + benchRandom() % 16;
+		*pos = benchRandom() % (total + 1);
+		break;
+		case MIX_FIND:
+		op = (dice < 50) ? OP_FIND : OP_COLLECT_STRSTR;
+		*length = FIND_NEEDLE;
+		*pos = benchRandom() % (total + 1);
+		break;
+		case MIX_SAVELOAD:
+		op = (dice < 25) ? OP_SAVE : (dice < 50) ? OP_LOAD : (dice < 75) ? OP_SAVE_TEXT : OP_LOAD_TEXT;
+		*length = 0;
+		*pos = benchRandom() % (total + 1);
+		break;
+		case MIX_LINES:
+		op = (dice < 50) ? OP_LINE_TO_OFFSET : OP_OFFSET_TO_LINE;
+		*length = 0;
+		*pos = benchRandom() % (total + 1);
+		break;
+		case MIX_APPEND:
+		*length = 1 + benchRandom() % 64;
+		op = (dice < 95) ? OP_APPEND : OP_COLLECT;
+		*pos = total;
+		break;
+		default:
+		op = (dice < 30) ? OP_INSERT : (dice < 50) ? OP_DELETE : (dice < 70) ? OP_COLLECT : (dice < 90) ? OP_KTHCHAR : OP_SPLIT;
+		*length = (op == OP_COLLECT) ? 64 : 1 + benchRandom() % 16;
+		if (mix == MIX_SEQUENTIAL) {
+			*caret += *length;
+			if (*caret >= total)
+				*caret = 0;
+			*pos = *caret;
+		}
+		else
+			*pos = benchRandom() % (total + 1);
+		break;
+	}
+	if (op == OP_INSERT || op == OP_APPEND || op == OP_FINGER_INSERT)
+		*pos = sizeMin(*pos, total);
+	else if (op == OP_DELETE || op == OP_COLLECT || op == OP_FINGER_DELETE || op == OP_PUBLISH) { // Keep the range inside the rope
+		*length = sizeMin(*length, total);
+		*pos = sizeMin(*pos, total - *length);
+	}
+	else if (total > 0)
+		*pos = sizeMin(*pos, total - 1);
+	return op;
+}
+
+// Reads the published rope of the document until stop is set
+// Each read collects 64 characters at a random position and checks them against kthChar in the same version,
+// so a version that changes under a reader or is freed too early shows up as a mismatch or under ASan
+void* benchRead (void* arg) {
+	struct benchReader* reader = arg;
+	int slot = readerSlot(reader->document);
+	if (slot < 0)
+		errorOccurred();
+	while (atomic_load_explicit(reader->stop, memory_order_relaxed) == 0) {
+		struct node* rope = readBegin(reader->document, slot);
+		ropeSize total = rope->leftLen;
+		if (total >= 64) {
+			reader->state ^= reader->state << 13;
+			reader->state ^= reader->state >> 7;
+			reader->state ^= reader->state << 17;
+			ropeSize pos = reader->state % (total - 63);
+			char* chars = collect(rope, pos + 1, pos + 64);
+			if (chars == NULL)
+				errorOccurred();
+			if (strlen(chars) != 64 || chars[0] != kthChar(rope, pos) || chars[63] != kthChar(rope, pos + 63))
+				benchMismatch("a document reader");
+			free (chars);
+		}
+		readEnd(reader->document, slot);
+		reader->reads++;
+	}
+	releaseReaderSlot(reader->document, slot);
+	return NULL;
+}
+
+int comparePositions (const void* a, const void* b) {
+	ropeSize x = ((const struct ropeEdit*) a)->position, y = ((const struct ropeEdit*) b)->position;
+	return (x > y) - (x < y);
+}
+
+// Makes count random edits of the rope at increasing positions with ranges that do not overlap,
+// inserting up to 16 characters of text and deleting up to 8
+void benchEdits (struct ropeEdit* edits, const int count, const ropeSize total, const char* text) {
+	for (int k = 0; k < count; k++)
+		edits[k].position = 1 + benchRandom() % (total + 1);
+	qsort(edits, count, sizeof(struct ropeEdit), comparePositions);
+	for (int k = 0; k < count; k++) {
+		ropeSize next = (k + 1 < count) ? edits[k + 1].position : total + 1;
+		edits[k].deleteLength = sizeMin(benchRandom() % 9, next - edits[k].position);
+		edits[k].data = text;
+		edits[k].length = benchRandom() % 17;
+	}
+}
+
+// Runs one operation of the batch mix: the edits are made on a snapshot one at a time, from the last one
+// so that the positions stay valid, and on the rope with applyBatch, and the two are compared
+void benchBatch (struct benchRope* r, struct ropeEdit* edits, const int count, struct benchSamples* samples) {
+	struct node* copy = snapshot(r->rope);
+	if (copy == NULL)
+		errorOccurred();
+	double t = benchNow();
+	for (int k = count - 1; k >= 0; k--) {
+		if (edits[k].deleteLength > 0)
+			copy = delete(copy, edits[k].position, edits[k].position + edits[k].deleteLength - 1);
+		if (edits[k].length > 0)
+			copy = insertBytes(copy, edits[k].position, edits[k].data, edits[k].length);
+	}
+	t = benchNow() - t;
+	samples[OP_SEQUENTIAL_EDITS].ns[samples[OP_SEQUENTIAL_EDITS].count++] = (long) (t * 1e9);
+	samples[OP_SEQUENTIAL_EDITS].total += t;
+	currentError = OK;
+	t = benchNow();
+	r->rope = applyBatch(r->rope, edits, count);
+	t = benchNow() - t;
+	samples[OP_APPLY_BATCH].ns[samples[OP_APPLY_BATCH].count++] = (long) (t * 1e9);
+	samples[OP_APPLY_BATCH].total += t;
+	if (currentError != OK || ropeEqual(r->rope, copy) == 0)
+		benchMismatch("applyBatch");
+	freeAll(copy);
+}
+
+#define LARGE_PIECE (1 << 20) // Characters of the piece that the large mix doubles
+
+// Returns the character at index p of the rope of the large mix
+char largeChar (const ropeSize p) {
+	return (p % LARGE_PIECE % 61 == 60) ? '\n' : 'a' + p % LARGE_PIECE % 26;
+}
+
+// Returns the number of newlines before index p of the rope of the large mix
+ropeSize largeLines (const ropeSize p) {
+	return p / LARGE_PIECE * (LARGE_PIECE / 61) + p % LARGE_PIECE / 61;
+}
+
+// Checks the character, up to 100 characters from it, the line and the code point at index p of the large rope
+void largeCheck (struct node* rope, const ropeSize p) {
+	ropeSize end = sizeMin(p + 100, rope->leftLen);
+	char* chars = collect(rope, p + 1, end);
+	if (chars == NULL)
+		errorOccurred();
+	for (ropeSize k = p; k < end; k++)
+		if (chars[k - p] != largeChar(k))
+			benchMismatch("collect");
+	free (chars);
+	if (kthChar(rope, p) != largeChar(p))
+		benchMismatch("kthChar");
+	ropeSize line = offsetToLine(rope, p);
+	if (line != largeLines(p))
+		benchMismatch("offsetToLine");
+	ropeSize start = lineToOffset(rope, line);
+	if (start > p || largeLines(start) != line || (start > 0 && largeChar(start - 1) != '\n'))
+		benchMismatch("lineToOffset");
+	if (byteToCodePoint(rope, p) != p || codePointToByte(rope, p) != p) // All characters are ASCII
+		benchMismatch("byteToCodePoint");
+}
+
+// Writes the marker of the file check of the large mix at index at into text, and returns its length
+int largeMarker (char* text, const ropeSize at) {
+	return snprintf(text, 32, "marker at %lld\n", (long long) at);
+}
+
+// Checks a rope of the file check of the large mix: size characters that are zeros except for count markers,
+// one line each.  The length and the counts of the root are checked, and each marker with the zero before it
+// and the lines around it, so a file of more than 4 GiB is read above 4 GiB
+void largeFileCheck (struct node* rope, const ropeSize size, const ropeSize* markers, const int count, const char* what) {
+	if (rope == NULL || rope->leftLen != size || rope->leftLines != count || rope->leftChars != size)
+		benchMismatch(what);
+	for (int k = 0; k < count; k++) {
+		char expected[32];
+		int length = largeMarker(expected, markers[k]);
+		char* chars = collect(rope, markers[k] + 1, markers[k] + length);
+		if (chars == NULL || memcmp(chars, expected, length) != 0 || kthChar(rope, markers[k] - 1) != '\0')
+			benchMismatch(what);
+		free (chars);
+		if (offsetToLine(rope, markers[k]) != k || lineToOffset(rope, k + 1) != markers[k] + length)
+			benchMismatch(what);
+	}
+}
+
+// The file check of the large mix: a sparse file of size characters with a few markers, most of them
+// above 4 GiB if the file is longer, is opened with ropeFromFile, saved with saveRope and loaded with
+// loadRope, and each rope is checked.  The files are removed as soon as they are mapped, and the leaves
+// have LARGE_PIECE characters, so that the ropes take little memory; the saved file needs size bytes of disk
+// Sets the times of the three steps in milliseconds
+void largeFile (const ropeSize size, double* openTime, double* saveTime, double* loadTime) {
+	const char* directory = getenv("TMPDIR");
+	char path[4096];
+	snprintf(path, sizeof(path) - 8, "%s/RopeBench-XXXXXX", directory != NULL ? directory : "/tmp");
+	int fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, size) != 0) {
+		fprintf(stderr, "RopeBench: cannot make a sparse file of %lld bytes in %s\n", (long long) size, path);
+		exit(1);
+	}
+	const ropeSize wanted[] = {(1LL << 31) - 3, (1LL << 32) - 3, (1LL << 32) + 5, size - 40};
+	ropeSize markers[4];
+	int count = 0;
+	for (int k = 0; k < 4; k++)
+		if (wanted[k] > (count > 0 ? markers[count - 1] + 32 : 0) && wanted[k] + 32 <= size)
+			markers[count++] = wanted[k];
+	for (int k = 0; k < count; k++) {
+		char text[32];
+		int length = largeMarker(text, markers[k]);
+		if (pwrite(fd, text, length, markers[k]) != length)
+			benchMismatch("pwrite");
+	}
+	close(fd);
+
+	double t = benchNow();
+	struct node* opened = ropeFromFile(path, LARGE_PIECE);
+	*openTime = benchNow() - t;
+	unlink(path);
+	largeFileCheck(opened, size, markers, count, "ropeFromFile");
+	strcat(path, ".rope");
+	t = benchNow();
+	if (saveRope(opened, path) == 0)
+		benchMismatch("saveRope");
+	*saveTime = benchNow() - t;
+	freeAll(opened);
+	t = benchNow();
+	struct node* loaded = loadRope(path);
+	*loadTime = benchNow() - t;
+	unlink(path);
+	largeFileCheck(loaded, size, markers, count, "loadRope");
+	freeAll(loaded);
+}
+
+// Runs the large mix and prints its timings, or exits at the first wrong result
+int benchLarge (const struct benchOptions* options) {
+	ropeSize size = options->size;
+	char* piece = malloc(LARGE_PIECE);
+	if (piece == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	for (int k = 0; k < LARGE_PIECE; k++)
+		piece[k] = largeChar(k);
+	double t = benchNow();
+	struct node* r;
+	if (options->engine == ENGINE_BINARY)
+		r = ropeFromBuffer(piece, LARGE_PIECE, options->leaf, 1);
+	else {
+		struct node* whole = insertBytes(newArenaRope(), 1, piece, LARGE_PIECE);
+		r = rebuild(whole, options->leaf);
+		freeAll(whole);
+	}
+	free (piece);
+	while (r->leftLen < size) { // The rope is joined with a snapshot of itself, or of its beginning at last
+		struct node* copy = snapshot(r);
+		if (copy == NULL)
+			errorOccurred();
+		if (2 * r->leftLen > size)
+			freeAll(split(copy, size - r->leftLen));
+		benchJoin(r, copy);
+	}
+	double buildTime = benchNow() - t;
+	if (r->leftLen != size || r->leftLines != largeLines(size) || r->leftChars != size)
+		benchMismatch("the build");
+	struct ropeStats stats;
+	ropeStats(r, &stats);
+
+	t = benchNow();
+	const ropeSize positions[] = {0, (1LL << 31) - 1, 1LL << 31, (1LL << 32) - 1, 1LL << 32, (1LL << 32) + 5,
+	  size / 2, size - 1};
+	for (int k = 0; k < (int) (sizeof(positions) / sizeof(ropeSize)); k++)
+		if (positions[k] < size)
+			largeCheck(r, positions[k]);
+	for (int k = 0; k < 64; k++)
+		largeCheck(r, benchRandom() % size);
+	double checkTime = benchNow() - t;
+
+	// The needle is near the end, so ropeFind reads the whole rope before it
+	ropeSize at = size - LARGE_PIECE / 2;
+	r = insertBytes(r, at + 1, "NEEDLE", 6);
+	t = benchNow();
+	if (ropeFind(r, "NEEDLE", 6, 0) != at)
+		benchMismatch("ropeFind");
+	double findTime = benchNow() - t;
+	r = delete(r, at + 1, at + 6);
+
+	ropeSize cut = (size > (1LL << 32) + LARGE_PIECE) ? (1LL << 32) + 123457 : size / 2 + 1;
+	t = benchNow();
+	struct node* right = split(r, cut);
+	double splitTime = benchNow() - t;
+	if (right == NULL || r->leftLen != cut || right->leftLen != size - cut)
+		benchMismatch("split");
+	if (r->leftLines != largeLines(cut) || right->leftLines != largeLines(size) - largeLines(cut)
+	  || kthChar(r, cut - 1) != largeChar(cut - 1) || kthChar(right, 0) != largeChar(cut))
+		benchMismatch("split");
+
+	// 21 characters around 2 GiB, or around the middle of the left part if it is shorter
+	ropeSize middle = (cut > (1LL << 31) + 10) ? 1LL << 31 : cut / 2;
+	t = benchNow();
+	r = delete(r, middle - 9, middle + 11);
+	double deleteTime = benchNow() - t;
+	if (r->leftLen != cut - 21 || kthChar(r, middle - 11) != largeChar(middle - 11) || kthChar(r, middle - 10) != largeChar(middle + 11))
+		benchMismatch("delete");
+
+	t = benchNow();
+	benchJoin(r, right);
+	double concatTime = benchNow() - t;
+	if (r->leftLen != size - 21 || kthChar(r, cut - 21) != largeChar(cut) || kthChar(r, size - 22) != largeChar(size - 1)
+	  || r->leftLines != largeLines(size) - (largeLines(middle + 11) - largeLines(middle - 10)))
+		benchMismatch("concat");
+	freeAll(r);
+
+	double openTime, saveTime, loadTime;
+	largeFile(size, &openTime, &saveTime, &loadTime);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("{\"engine\": \"%s\", \"mix\": \"large\", \"size\": %lld, \"leaf\": %d, \"seed\": %llu,\n",
+	  engineNames[options->engine], (long long) size, options->leaf, options->seed);
+	printf(" \"build_ms\": %.3f, \"depth\": %d, \"leaves\": %d, \"peak_rss_kib\": %ld,\n",
+	  buildTime * 1e3, stats.depth, stats.leaves, usage.ru_maxrss);
+	printf(" \"checks_ms\": %.3f, \"find_ms\": %.3f, \"split_ms\": %.3f, \"delete_ms\": %.3f, \"concat_ms\": %.3f,\n",
+	  checkTime * 1e3, findTime * 1e3, splitTime * 1e3, deleteTime * 1e3, concatTime * 1e3);
+	printf(" \"file_open_ms\": %.3f, \"save_ms\": %.3f, \"load_ms\": %.3f, \"ok\": true}\n",
+	  openTime * 1e3, saveTime * 1e3, loadTime * 1e3);
+	return 0;
+}
+
+// Runs count queries of the skewed mix at random positions, each a kthChar and a collect of 64 characters,
+// and sets times[0] and times[1] to their mean times in nanoseconds; the collect follows the kthChar
+// at the same position, so it finds the path in the cache
+// Returns the sum of the characters read, so that the same queries can be checked on the rebalanced rope
+unsigned long long skewedQueries (struct node* rope, const long count, double* times) {
+	ropeSize total = rope->leftLen;
+	unsigned long long sum = 0;
+	times[0] = times[1] = 0;
+	for (long k = 0; k < count && total >= 64; k++) {
+		ropeSize pos = benchRandom() % (total - 63);
+		double t = benchNow();
+		sum += (unsigned char) kthChar(rope, pos);
+		times[0] += benchNow() - t;
+		t = benchNow();
+		char* chars = collect(rope, pos + 1, pos + 64);
+		times[1] += benchNow() - t;
+		if (chars == NULL)
+			errorOccurred();
+		sum += (unsigned char) chars[63];
+		free (chars);
+	}
+	for (int k = 0; k < 2; k++)
+		times[k] = (count > 0) ? times[k] * 1e9 / count : 0;
+	return sum;
+}
+
+// The skewed mix: a rope of --size characters is built from scratch by inserts of 1 to 64 characters,
+// each at the front or at the back, so that the tree only ever grows at its two edges; the queries
+// are timed at the same positions before and after rebalanceRope, with the depth and leaves of both trees
+int benchSkewed (const struct benchOptions* options) {
+	char text[64];
+	for (int k = 0; k < 64; k++)
+		text[k] = 'a' + k % 26;
+	text[63] = '\n';
+	double t = benchNow();
+	struct node* r = (options->engine == ENGINE_ARENA) ? newArenaRope() : initNode(0);
+	for (ropeSize length = 0; r != NULL && length < options->size; ) {
+		int piece = (int) sizeMin(1 + benchRandom() % 64, options->size - length);
+		r = insertBytes(r, (benchRandom() % 2 == 0) ? 1 : length + 1, text + 64 - piece, piece);
+		length += piece;
+	}
+	if (r == NULL)
+		errorOccurred();
+	double buildTime = benchNow() - t;
+
+	struct ropeStats before, after;
+	double beforeTimes[2], afterTimes[2];
+	ropeStats(r, &before);
+	unsigned long long state = benchState;
+	unsigned long long sum = skewedQueries(r, options->ops, beforeTimes);
+	t = benchNow();
+	r = rebalanceRope(r);
+	double rebalanceTime = benchNow() - t;
+	if (currentError != OK)
+		errorOccurred();
+	ropeStats(r, &after);
+	benchState = state; // The same positions again
+	if (skewedQueries(r, options->ops, afterTimes) != sum || after.leaves != before.leaves || r->leftLen != options->size)
+		benchMismatch("rebalanceRope");
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("{\"engine\": \"%s\", \"mix\": \"skewed\", \"size\": %lld, \"ops\": %ld, \"seed\": %llu,\n",
+	  engineNames[options->engine], (long long) options->size, options->ops, options->seed);
+	printf(" \"build_ms\": %.3f, \"rebalance_ms\": %.3f, \"leaves\": %d, \"peak_rss_kib\": %ld,\n",
+	  buildTime * 1e3, rebalanceTime * 1e3, after.leaves, usage.ru_maxrss);
+	printf(" \"before\": {\"depth\": %d, \"kthChar_mean_ns\": %.0f, \"collect_mean_ns\": %.0f},\n",
+	  before.depth, beforeTimes[0], beforeTimes[1]);
+	printf(" \"after\": {\"depth\": %d, \"kthChar_mean_ns\": %.0f, \"collect_mean_ns\": %.0f}}\n",
+	  after.depth, afterTimes[0], afterTimes[1]);
+	freeAll(r);
+	return 0;
+}
+
+// Returns the mean time of the samples in seconds, or 0 if there are none
+double benchMean (const struct benchSamples* s) {
+	return (s->count > 0) ? s->total / s->count : 0;
+}
+
+int compareLongs (const void* a, const void* b) {
+	long x = *(const long*) a, y = *(const long*) b;
+	return (x > y) - (x < y);
+}
+
+// Returns the latency below which the given fraction of the samples are, the samples must be sorted
+long percentile (const struct benchSamples* s, const double fraction) {
+	if (s->count == 0)
+		return 0;
+	long k = (long) (fraction * (s->count - 1) + 0.5);
+	return s->ns[k];
+}
+
+// Reads a count with an optional k, M or G suffix
+ropeSize benchCount (const char* text) {
+	char* end;
+	ropeSize value = strtoll(text, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		value <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		value <<= 20;
+	else if (*end == 'g' || *end == 'G')
+		value <<= 30;
+	return value;
+}
+
+// Returns the index of name in names, or -1
+int benchChoice (const char* name, const char** names, const int count) {
+	for (int k = 0; k < count; k++)
+		if (strcmp(name, names[k]) == 0)
+			return k;
+	return -1;
+}
+
+void benchUsage () {
+	fprintf(stderr, "usage: RopeBench [--engine binary|arena|wide] [--mix random|sequential|typing|append|nearby|fingertyping|cutpaste|compare|document|batch|large|find|saveload|lines|skewed]\n"
+	  "                 [--size characters] [--leaf characters] [--ops count] [--seed number] [--threads count]\n"
+	  "                 [--block characters] [--readers count] [--batch count]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main (int argc, char** argv) {
+	struct benchOptions options = {ENGINE_BINARY, MIX_RANDOM, 1 << 24, 1024, 200000, 88172645463325252ULL, 1, 1 << 20, 4, 10000};
+	for (int k = 1; k < argc; k++) {
+		if (k + 1 == argc)
+			benchUsage();
+		const char* value = argv[++k];
+		if (strcmp(argv[k - 1], "--engine") == 0)
+			options.engine = benchChoice(value, engineNames, 3);
+		else if (strcmp(argv[k - 1], "--mix") == 0)
+			options.mix = benchChoice(value, mixNames, 15);
+		else if (strcmp(argv[k - 1], "--size") == 0)
+			options.size = benchCount(value);
+		else if (strcmp(argv[k - 1], "--leaf") == 0)
+			options.leaf = benchCount(value);
+		else if (strcmp(argv[k - 1], "--ops") == 0)
+			options.ops = benchCount(value);
+		else if (strcmp(argv[k - 1], "--seed") == 0)
+			options.seed = strtoull(value, NULL, 10);
+		else if (strcmp(argv[k - 1], "--threads") == 0)
+			options.threads = benchCount(value);
+		else if (strcmp(argv[k - 1], "--block") == 0)
+			options.block = benchCount(value);
+		else if (strcmp(argv[k - 1], "--readers") == 0)
+			options.readers = benchCount(value);
+		else if (strcmp(argv[k - 1], "--batch") == 0)
+			options.batch = benchCount(value);
+		else
+			benchUsage();
+	}
+	// The wide rope has no compare, document, applyBatch, lines, ropeFind, rope files or rebalanceRope
+	if ((options.mix == MIX_COMPARE || options.mix == MIX_DOCUMENT || options.mix == MIX_BATCH || options.mix == MIX_LARGE
+	  || options.mix == MIX_FIND || options.mix == MIX_SAVELOAD || options.mix == MIX_LINES || options.mix == MIX_SKEWED)
+	  && options.engine == ENGINE_WIDE)
+		benchUsage();
+	if ((int) options.engine < 0 || (int) options.mix < 0 || options.size < 0 || options.leaf <= 0 || options.ops < 0 || options.threads <= 0 || options.block <= 0
+	  || options.readers < 0 || options.readers > ROPE_MAX_READERS || options.batch <= 0
+	  || (options.mix == MIX_LARGE && options.size < 2 * LARGE_PIECE) || (options.mix == MIX_FIND && options.block < FIND_NEEDLE))
+		benchUsage();
+	benchState = options.seed | 1;
+	if (options.mix == MIX_LARGE)
+		return benchLarge(&options);
+	if (options.mix == MIX_SKEWED)
+		return benchSkewed(&options);
+
+	char* buffer = malloc(options.size + 1);
+	char text[64];
+	struct benchSamples samples[OP_COUNT];
+	for (int k = 0; k < OP_COUNT; k++) {
+		samples[k].ns = malloc(options.ops * sizeof(long) + 1);
+		samples[k].count = 0;
+		samples[k].total = 0;
+		if (samples[k].ns == NULL)
+			buffer = NULL;
+	}
+	if (buffer == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	for (ropeSize k = 0; k < options.size; k++)
+		buffer[k] = (benchRandom() % 61 == 0) ? '\n' : 'a' + benchRandom() % 26;
+	for (int k = 0; k < 64; k++)
+		text[k] = 'A' + k % 26;
+	text[63] = '\n'; // Appends take the end of the text, so each one is a line
+	if (options.mix == MIX_FIND) // A needle at the start of every block, where it fits
+		for (ropeSize k = 0; k + FIND_NEEDLE <= options.size; k += options.block)
+			memcpy(buffer + k, text, FIND_NEEDLE);
+
+	long allocsBefore = atomic_load(&benchAllocs);
+	double start = benchNow();
+	struct benchRope r = {.engine = options.engine, .needles = options.block, .leaf = options.leaf}; // The other members start empty
+	if (options.engine == ENGINE_WIDE)
+		r.wide = wideFromBuffer(buffer, options.size);
+	else if (options.engine == ENGINE_BINARY)
+		r.rope = ropeFromBuffer(buffer, options.size, options.leaf, options.threads);
+	else { // The arena copy is made by rebuild from a rope in the arena
+		struct node* whole = newArenaRope();
+		for (ropeSize k = 0; k < options.size; k += INT32_MAX)
+			whole = insertBytes(whole, k + 1, buffer + k, sizeMin(INT32_MAX, options.size - k));
+		r.rope = rebuild(whole, options.leaf);
+		if (r.rope != whole)
+			freeAll(whole);
+	}
+	if (r.rope == NULL && r.wide == NULL)
+		errorOccurred();
+	double buildTime = benchNow() - start;
+	long buildAllocs = atomic_load(&benchAllocs) - allocsBefore;
+	free (buffer);
+	if (options.mix == MIX_COMPARE && options.size > 0) {
+		// A character inserted and deleted again in the middle copies one path of the snapshot
+		r.snapshot = snapshot(r.rope);
+		r.snapshot = insertBytes(r.snapshot, options.size / 2 + 1, text, 1);
+		r.snapshot = delete(r.snapshot, options.size / 2 + 1, options.size / 2 + 1);
+		r.copy = rebuild(r.rope, options.leaf + options.leaf / 2 + 1);
+		if (r.snapshot == NULL || r.copy == NULL)
+			errorOccurred();
+	}
+	char paths[2][4096];
+	if (options.mix == MIX_SAVELOAD && options.size > 0) { // Both files are saved once, so that the loads find them
+		const char* directory = getenv("TMPDIR");
+		snprintf(paths[1], sizeof(paths[1]) - 8, "%s/RopeBench-XXXXXX", directory != NULL ? directory : "/tmp");
+		int fd = mkstemp(paths[1]);
+		if (fd < 0) {
+			fprintf(stderr, "RopeBench: cannot make a file in %s\n", paths[1]);
+			exit(1);
+		}
+		close(fd);
+		strcpy(paths[0], paths[1]);
+		strcat(paths[0], ".rope");
+		r.files[0] = paths[0];
+		r.files[1] = paths[1];
+		benchRun(&r, OP_SAVE, 0, 0, text);
+		benchRun(&r, OP_SAVE_TEXT, 0, 0, text);
+	}
+	struct ropeEdit* edits = malloc((options.mix == MIX_BATCH ? options.batch : 1) * sizeof(struct ropeEdit));
+	if (edits == NULL) {
+		currentError = ALLOC;
+		errorOccurred();
+	}
+	struct benchReader* readers = NULL;
+	atomic_int stop = 0;
+	if (options.mix == MIX_DOCUMENT) {
+		r.document = newDocument(r.rope);
+		readers = calloc(options.readers + 1, sizeof(struct benchReader));
+		if (r.document == NULL || readers == NULL) {
+			currentError = ALLOC;
+			errorOccurred();
+		}
+		for (int k = 0; k < options.readers; k++) {
+			readers[k].document = r.document;
+			readers[k].state = (options.seed + k + 1) * 0x9E3779B97F4A7C15ULL | 1;
+			readers[k].stop = &stop;
+		}
+	}
+
+	allocsBefore = atomic_load(&benchAllocs);
+	long freesBefore = atomic_load(&benchFrees);
+#ifdef ROPE_COUNTERS
+	resetRopeCounters();
+#endif
+	ropeSize caret = benchLength(&r) / 2;
+	double runStart = benchNow();
+	for (int k = 0; readers != NULL && k < options.readers; k++)
+		if (pthread_create(&readers[k].thread, NULL, benchRead, readers + k) != 0) {
+			currentError = ALLOC;
+			errorOccurred();
+		}
+	for (long k = 0; k < options.ops; k++) {
+		ropeSize pos;
+		int length;
+		if (options.mix == MIX_BATCH) {
+			benchEdits(edits, options.batch, benchLength(&r), text);
+			benchBatch(&r, edits, options.batch, samples);
+			continue;
+		}
+		enum BenchOp op = benchNext(options.mix, benchLength(&r), options.block, &caret, &pos, &length);
+		if (op != OP_INSERT && op != OP_APPEND && op != OP_FINGER_INSERT && benchLength(&r) == 0)
+			continue;
+		double t = benchNow();
+		benchRun(&r, op, pos, length, text);
+		t = benchNow() - t;
+		samples[op].ns[samples[op].count++] = (long) (t * 1e9);
+		samples[op].total += t;
+	}
+	long reads = 0;
+	atomic_store(&stop, 1);
+	for (int k = 0; readers != NULL && k < options.readers; k++) {
+		pthread_join(readers[k].thread, NULL);
+		reads += readers[k].reads;
+	}
+	double runTime = benchNow() - runStart;
+	long runAllocs = atomic_load(&benchAllocs) - allocsBefore, runFrees = atomic_load(&benchFrees) - freesBefore;
+#ifdef ROPE_COUNTERS
+	struct ropeCounters counters = ropeCounters; // Before the rebuild below counts too
+#endif
+
+	int depth = 0;
+	long leaves = 0;
+	double rebuildTime = 0;
+	struct ropeStats stats = {0};
+	if (options.engine == ENGINE_WIDE) {
+		depth = (r.wide->root != NULL) ? r.wide->root->height : 0;
+		leaves = (r.wide->length + WIDE_LEAF_SIZE - 1) / WIDE_LEAF_SIZE; // Lower bound, leaves need not be full
+	}
+	else {
+		ropeStats(r.rope, &stats);
+		depth = stats.depth;
+		leaves = stats.leaves;
+		if (r.rope->leftLen > 0) {
+			double t = benchNow();
+			struct node* copy = rebuild(r.rope, options.leaf);
+			rebuildTime = benchNow() - t;
+			freeAll(copy);
+		}
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"engine\": \"%s\", \"mix\": \"%s\", \"size\": %lld, \"leaf\": %d, \"ops\": %ld, \"seed\": %llu, \"threads\": %d,\n",
+	  engineNames[options.engine], mixNames[options.mix], (long long) options.size,
+	  options.engine == ENGINE_WIDE ? WIDE_LEAF_SIZE : options.leaf, options.ops, options.seed,
+	  options.engine == ENGINE_BINARY ? options.threads : 1);
+	if (options.mix == MIX_CUTPASTE || options.mix == MIX_FIND)
+		printf(" \"block\": %d,\n", options.block);
+	if (options.mix == MIX_BATCH)
+		printf(" \"batch\": %d,\n", options.batch);
+	if (options.mix == MIX_SAVELOAD)
+		printf(" \"save_ms\": %.3f, \"load_ms\": %.3f, \"save_text_ms\": %.3f, \"load_text_ms\": %.3f, \"load_rss_kib\": %ld, \"load_text_rss_kib\": %ld,\n",
+		  benchMean(samples + OP_SAVE) * 1e3, benchMean(samples + OP_LOAD) * 1e3, benchMean(samples + OP_SAVE_TEXT) * 1e3,
+		  benchMean(samples + OP_LOAD_TEXT) * 1e3, r.resident[0], r.resident[1]);
+	if (options.mix == MIX_DOCUMENT)
+		printf(" \"readers\": %d, \"reads\": %ld, \"reads_per_s\": %.0f,\n", options.readers, reads, runTime > 0 ? reads / runTime : 0);
+	printf(" \"build_ms\": %.3f, \"build_allocs\": %ld, \"run_ms\": %.3f, \"ops_per_s\": %.0f, \"run_allocs\": %ld, \"run_frees\": %ld,\n",
+	  buildTime * 1e3, buildAllocs, runTime * 1e3, runTime > 0 ? options.ops / runTime : 0, runAllocs, runFrees);
+	printf(" \"rebuild_ms\": %.3f, \"length\": %lld, \"depth\": %d, \"leaves\": %ld, \"peak_rss_kib\": %ld,\n",
+	  rebuildTime * 1e3, (long long) benchLength(&r), depth, leaves, usage.ru_maxrss);
+	if (options.engine != ENGINE_WIDE) {
+		int last = ROPE_HISTOGRAM_SIZE - 1;
+		while (last > 0 && stats.leafSizes[last] == 0)
+			last--;
+		printf(" \"shared_leaves\": %d, \"leaf_sizes\": [", stats.sharedLeaves); // Leaves of 0, 1, 2-3, 4-7, ... characters
+		for (int k = 0; k <= last; k++)
+			printf("%s%d", k > 0 ? ", " : "", stats.leafSizes[k]);
+		printf("],\n");
+	}
+#ifdef ROPE_COUNTERS
+	printf(" \"counters\": {\"nodes_allocated\": %lld, \"nodes_freed\": %lld, \"splits\": %lld, \"concats\": %lld, \"leaf_splits\": %lld,\n",
+	  (long long) counters.nodesAllocated, (long long) counters.nodesFreed, (long long) counters.splits,
+	  (long long) counters.concats, (long long) counters.leafSplits);
+	printf("  \"descents\": %lld, \"descent_steps\": %lld, \"collect_bytes\": %lld, \"leaf_split_bytes\": %lld},\n",
+	  (long long) counters.descents, (long long) counters.descentSteps, (long long) counters.collectBytes,
+	  (long long) counters.leafSplitBytes);
+#endif
+	printf(" \"operations\": {");
+	for (int k = 0, first = 1; k < OP_COUNT; k++) {
+		struct benchSamples* s = samples + k;
+		if (s->count == 0)
+			continue;
+		qsort(s->ns, s->count, sizeof(long), compareLongs);
+		printf("%s\n  \"%s\": {\"count\": %ld, \"ops_per_s\": %.0f, \"mean_ns\": %.0f, \"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, \"max_ns\": %ld}",
+		  first ? "" : ",", opNames[k], s->count, s->total > 0 ? s->count / s->total : 0, s->total * 1e9 / s->count,
+		  percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99), s->ns[s->count - 1]);
+		first = 0;
+	}
+	printf("}}\n");
+
+	if (r.snapshot != NULL) { // Before the rope, which may own the arena of the snapshot
+		freeAll(r.snapshot);
+		freeAll(r.copy);
+	}
+	if (options.engine == ENGINE_WIDE)
+		freeWideRope(r.wide);
+	else if (r.document != NULL)
+		freeDocument(r.document);
+	else
+		freeAll(r.rope);
+	if (r.files[0] != NULL) {
+		unlink(r.files[0]);
+		unlink(r.files[1]);
+	}
+	free (readers);
+	free (edits);
+	for (int k = 0; k < OP_COUNT; k++)
+		free (samples[k].ns);
+	return 0;
+}